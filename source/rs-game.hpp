@@ -4,5 +4,6 @@
 #include "rs-game/english.hpp"
 #include "rs-game/hexmap.hpp"
 #include "rs-game/markov.hpp"
+#include "rs-game/stream-rng.hpp"
 #include "rs-game/text-gen.hpp"
 #include "rs-game/version.hpp"
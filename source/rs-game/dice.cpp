@@ -1,71 +1,607 @@
 #include "rs-game/dice.hpp"
-#include "rs-regex/regex.hpp"
-#include "rs-sci/algorithm.hpp"
-#include "rs-tl/algorithm.hpp"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <complex>
 #include <cstdlib>
 #include <iterator>
+#include <limits>
+#include <list>
+#include <numeric>
 #include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 
-using namespace RS::RE;
 using namespace RS::Sci;
 
 namespace RS::Game {
 
-    Dice::Dice(const std::string& str) {
+    namespace {
 
-        static const auto parse_integer = [] (const std::string& str, int def) noexcept {
-            return str.empty() ? def : Format::to_integer<int>(str);
+        using count_type = Detail::uint128;
+
+        constexpr count_type int_limit = std::uint64_t(std::numeric_limits<int>::max());
+
+        // Exploding dice are capped where the chance of going any further
+        // is below double precision, so the capped distribution agrees with
+        // the uncapped one to within rounding error
+
+        constexpr double explode_tail = std::numeric_limits<double>::epsilon();
+
+        // Tables with at least this many lattice points are built on
+        // multiple threads (zero disables this)
+
+        std::atomic<size_t> parallel_limit(1 << 12);
+
+        // Tokenizer shared by the dice parsers; white space is skipped and
+        // letters are case insensitive
+
+        class dice_scanner {
+        public:
+            explicit dice_scanner(std::string_view str) noexcept: str_(str) {}
+            [[noreturn]] void fail() const { throw std::invalid_argument("Invalid dice: " + std::string(str_)); }
+            void next() noexcept { ++pos_; }
+            bool at_digit() noexcept { auto c = peek(); return c >= '0' && c <= '9'; }
+            char peek() noexcept {
+                while (pos_ < str_.size() && Format::ascii_isspace(str_[pos_]))
+                    ++pos_;
+                if (pos_ == str_.size())
+                    return '\0';
+                char c = str_[pos_];
+                return c >= 'A' && c <= 'Z' ? char(c + 'a' - 'A') : c;
+            }
+            int parse_integer(int def) {
+                if (! at_digit())
+                    return def;
+                int n = 0;
+                while (at_digit()) {
+                    int digit = str_[pos_++] - '0';
+                    if (n > (std::numeric_limits<int>::max() - digit) / 10)
+                        fail();
+                    n = 10 * n + digit;
+                }
+                return n;
+            }
+            int parse_required() {
+                if (! at_digit())
+                    fail();
+                return parse_integer(0);
+            }
+            int parse_signed() {
+                auto c = peek();
+                if (c == '+' || c == '-')
+                    next();
+                int n = parse_required();
+                return c == '-' ? - n : n;
+            }
+        private:
+            std::string_view str_;
+            size_t pos_ = 0;
         };
 
-        static const Regex pattern(R"(
-            ( [+-] )                # [1] sign
-            (?:
-                (?: (\d+) [*x] ) ?  # [2] left multiplier
-                (\d*)               # [3] number of dice
-                d (\d*)             # [4] number of faces
-                (?: [*x] (\d+) ) ?  # [5] right multiplier
-            |
-                (\d+)               # [6] fixed modifier
-            )
-            (?: / (\d+) ) ?         # [7] divisor
-        )", Regex::anchor | Regex::extended | Regex::icase | Regex::optimize);
-
-        std::string text(str);
-        TL::remove_in_if(text, Format::ascii_isspace);
+        count_type gcd(count_type x, count_type y) noexcept {
+            while (x.high() != 0 || y.high() != 0) {
+                if (y == 0)
+                    return x;
+                x %= y;
+                std::swap(x, y);
+            }
+            return std::gcd(x.low(), y.low());
+        }
 
-        if (text.empty())
-            return;
+        bool try_multiply(count_type& x, count_type y) noexcept {
+            if (y != 0 && x > count_type::max() / y)
+                return false;
+            x *= y;
+            return true;
+        }
+
+        bool try_add(count_type& x, count_type y) noexcept {
+            if (x > count_type::max() - y)
+                return false;
+            x += y;
+            return true;
+        }
+
+        bool exact_fraction(count_type num, count_type den, Rational& result) noexcept {
+            auto g = gcd(num, den);
+            num /= g;
+            den /= g;
+            if (num > int_limit || den > int_limit)
+                return false;
+            result = Rational(int(num.low()), int(den.low()));
+            return true;
+        }
+
+        Rational make_probability(count_type num, count_type den) noexcept {
+
+            // Exact if the reduced fraction fits in a Rational, otherwise
+            // the nearest fraction that does. Follow the continued fraction
+            // convergents of num/den; when the next one is out of range, the
+            // largest semiconvergent that fits is closer than the previous
+            // convergent only if its last term is more than half the full
+            // term.
+
+            count_type h0 = 0, h1 = 1, k0 = 1, k1 = 0;
+
+            for (;;) {
+                auto a = num / den;
+                auto r = num % den;
+                auto limit = count_type::max();
+                if (h1 != 0)
+                    limit = (int_limit - h0) / h1;
+                if (k1 != 0)
+                    limit = std::min(limit, (int_limit - k0) / k1);
+                if (a > limit) {
+                    if (k1 == 0 || limit + limit > a) {
+                        h1 = limit * h1 + h0;
+                        k1 = limit * k1 + k0;
+                    }
+                    break;
+                }
+                auto h = a * h1 + h0;
+                auto k = a * k1 + k0;
+                h0 = h1;
+                h1 = h;
+                k0 = k1;
+                k1 = k;
+                if (r == 0)
+                    break;
+                num = den;
+                den = r;
+            }
+
+            return Rational(int(h1.low()), int(k1.low()));
 
-        if (text[0] != '+' && text[0] != '-')
-            text.insert(0, 1, '+');
+        }
 
-        size_t pos = 0;
+        Rational nearest_rational(double x) noexcept {
 
-        while (pos < text.size()) {
+            // A double is an exact binary fraction, so convert it to one and
+            // use the same approximation as for counts
 
-            auto match = pattern(text, pos);
-            auto sign = *match.begin() == '-' ? -1 : 1;
-            auto divisor = parse_integer(std::string(match[7]), 1);
+            if (x < 0)
+                return - nearest_rational(- x);
+            if (x >= double(std::numeric_limits<int>::max()))
+                return std::numeric_limits<int>::max();
 
-            if (match.matched(6)) {
+            int exponent = 0;
+            auto mantissa = std::uint64_t(std::ldexp(std::frexp(x, &exponent), 53));
+            int shift = 53 - exponent;
 
-                auto factor = parse_integer(std::string(match[6]), 1);
-                add_ += Rational(sign * factor, divisor);
+            if (shift >= 128)
+                return 0;
 
-            } else {
+            count_type den = shift < 64 ? count_type(std::uint64_t(1) << shift)
+                : count_type(std::uint64_t(1) << (shift - 64), 0);
+
+            return make_probability(mantissa, den);
+
+        }
+
+        template <typename T>
+        T probability(count_type num, count_type den) noexcept {
+            if constexpr (std::is_same_v<T, double>)
+                return double(num) / double(den);
+            else
+                return make_probability(num, den);
+        }
+
+        template <typename T>
+        T probability(double p) noexcept {
+            if constexpr (std::is_same_v<T, double>)
+                return p;
+            else
+                return nearest_rational(p);
+        }
+
+        bool exact_variance(count_type total, count_type sum, count_type sum_squares, Rational& result) noexcept {
+
+            // Reduce E(x) and E(x^2) before combining them, so the
+            // intermediate values stay within 128 bits for anything with a
+            // representable result
+
+            Rational mean, square;
+
+            if (! exact_fraction(sum, total, mean) || ! exact_fraction(sum_squares, total, square))
+                return false;
+
+            count_type p1 = std::uint64_t(mean.num());
+            count_type q1 = std::uint64_t(mean.den());
+            count_type p2 = std::uint64_t(square.num());
+            count_type q2 = std::uint64_t(square.den());
+
+            return exact_fraction(p2 * q1 * q1 - p1 * p1 * q2, q2 * q1 * q1, result);
+
+        }
+
+        // Convolution of probability arrays in double precision, using a
+        // radix-2 FFT for anything but small arrays. The FFT's absolute error
+        // is on the order of epsilon*log2(N), relative to the largest
+        // probability.
+
+        constexpr double pi = 3.14159265358979323846;
+        constexpr size_t direct_convolution_limit = 1 << 14;
+
+        using complex_vector = std::vector<std::complex<double>>;
+
+        void fft(complex_vector& a, bool inverse) {
+
+            size_t n = a.size();
+
+            for (size_t i = 1, j = 0; i < n; ++i) {
+                size_t bit = n >> 1;
+                for (; j & bit; bit >>= 1)
+                    j ^= bit;
+                j ^= bit;
+                if (i < j)
+                    std::swap(a[i], a[j]);
+            }
+
+            // Compute each root directly instead of by repeated
+            // multiplication, which would accumulate rounding error
+
+            complex_vector roots(n / 2);
+
+            for (size_t j = 0; j < n / 2; ++j)
+                roots[j] = std::polar(1.0, (inverse ? 2 : -2) * pi * double(j) / double(n));
+
+            for (size_t len = 2; len <= n; len <<= 1) {
+                size_t stride = n / len;
+                for (size_t i = 0; i < n; i += len) {
+                    for (size_t j = 0; j < len / 2; ++j) {
+                        auto u = a[i + j];
+                        auto v = a[i + j + len / 2] * roots[j * stride];
+                        a[i + j] = u + v;
+                        a[i + j + len / 2] = u - v;
+                    }
+                }
+            }
+
+            if (inverse)
+                for (auto& x: a)
+                    x /= double(n);
+
+        }
+
+        std::vector<double> fft_result(const complex_vector& a, size_t size) {
+            std::vector<double> result(size);
+            for (size_t i = 0; i < size; ++i)
+                result[i] = std::max(a[i].real(), 0.0);
+            return result;
+        }
+
+        size_t fft_size(size_t size) {
+            size_t n = 1;
+            while (n < size)
+                n <<= 1;
+            return n;
+        }
+
+        std::vector<double> convolve_real(const std::vector<double>& a, const std::vector<double>& b) {
+
+            size_t size = a.size() + b.size() - 1;
+
+            if (a.size() * b.size() <= direct_convolution_limit) {
+                std::vector<double> result(size, 0);
+                for (size_t i = 0; i < a.size(); ++i)
+                    for (size_t j = 0; j < b.size(); ++j)
+                        result[i + j] += a[i] * b[j];
+                return result;
+            }
+
+            size_t n = fft_size(size);
+            complex_vector x(a.begin(), a.end());
+            complex_vector y(b.begin(), b.end());
+            x.resize(n);
+            y.resize(n);
+            fft(x, false);
+            fft(y, false);
+
+            for (size_t i = 0; i < n; ++i)
+                x[i] *= y[i];
+
+            fft(x, true);
+
+            return fft_result(x, size);
+
+        }
+
+        std::vector<double> power_real(const std::vector<double>& a, int n) {
+
+            // Sum of n independent copies, raising the transform to the nth
+            // power by repeated squaring
+
+            size_t size = n * (a.size() - 1) + 1;
+
+            if (n == 1 || a.size() == 1 || size * a.size() <= direct_convolution_limit) {
+                std::vector<double> result = {1};
+                for (int i = 0; i < n; ++i)
+                    result = convolve_real(result, a);
+                return result;
+            }
+
+            size_t fn = fft_size(size);
+            complex_vector x(a.begin(), a.end());
+            x.resize(fn);
+            fft(x, false);
+
+            for (auto& z: x) {
+                std::complex<double> product = 1;
+                auto base = z;
+                for (int k = n; k > 0; k >>= 1) {
+                    if (k & 1)
+                        product *= base;
+                    base *= base;
+                }
+                z = product;
+            }
+
+            fft(x, true);
+
+            return fft_result(x, size);
+
+        }
+
+    }
+
+    // Table entries as probabilities, from the exact counts if there are
+    // any, otherwise from the normalized double precision table
+
+    template <typename T>
+    T Dice::table_data::pdf_at(size_t i) const {
+        return exact() ? probability<T>(pdf[i], total) : probability<T>(real_pdf[i]);
+    }
+
+    template <typename T>
+    T Dice::table_data::cdf_at(size_t i) const {
+        return exact() ? probability<T>(cdf[i], total) : probability<T>(real_cdf[i]);
+    }
+
+    template <typename T>
+    T Dice::table_data::ccdf_at(size_t i) const {
+        return exact() ? probability<T>(total - (i == 0 ? count_type(0) : cdf[i - 1]), total) : probability<T>(real_ccdf[i]);
+    }
+
+    // Cache of probability tables shared between equivalent Dice objects,
+    // keyed on the string form and evicted in least recently used order
+
+    class Dice::table_cache {
+
+    public:
+
+        static table_cache& get() noexcept {
+            static table_cache cache;
+            return cache;
+        }
+
+        bool enabled() const noexcept { return limit_ > 0; }
+        size_t hits() const noexcept { return hits_; }
+        size_t misses() const noexcept { return misses_; }
+
+        size_t size() noexcept {
+            auto lock = std::unique_lock(mutex_);
+            return index_.size();
+        }
+
+        void clear() noexcept {
+            auto lock = std::unique_lock(mutex_);
+            index_.clear();
+            list_.clear();
+            hits_ = misses_ = 0;
+        }
+
+        void set_limit(size_t n) noexcept {
+            auto lock = std::unique_lock(mutex_);
+            limit_ = n;
+            trim();
+        }
+
+        std::shared_ptr<const table_data> find(const std::string& key) {
+            auto lock = std::unique_lock(mutex_);
+            auto it = index_.find(key);
+            if (it == index_.end()) {
+                ++misses_;
+                return {};
+            }
+            ++hits_;
+            list_.splice(list_.begin(), list_, it->second);
+            return it->second->second;
+        }
+
+        void insert(const std::string& key, std::shared_ptr<const table_data> data) {
+            auto lock = std::unique_lock(mutex_);
+            if (index_.count(key) != 0)
+                return;
+            list_.emplace_front(key, std::move(data));
+            index_[key] = list_.begin();
+            trim();
+        }
+
+    private:
+
+        using entry_list = std::list<std::pair<std::string, std::shared_ptr<const table_data>>>;
+
+        std::mutex mutex_;
+        entry_list list_;
+        std::unordered_map<std::string, entry_list::iterator> index_;
+        std::atomic<size_t> limit_ = 0;
+        std::atomic<size_t> hits_ = 0;
+        std::atomic<size_t> misses_ = 0;
+
+        void trim() {
+            while (list_.size() > limit_) {
+                index_.erase(list_.back().first);
+                list_.pop_back();
+            }
+        }
+
+    };
+
+    Dice::Dice(int n, const std::vector<int>& faces, const Rational& factor) {
+        std::vector<std::pair<int, int>> weighted;
+        for (auto x: faces)
+            weighted.push_back({x, 1});
+        insert(n, weighted, factor);
+        modified();
+    }
+
+    Dice::Dice(std::string_view str) {
+
+        // Single pass parser, equivalent to matching this regex against the
+        // string with all white space removed, and a leading sign inserted
+        // if necessary:
+        //
+        //      ( [+-] )                # sign
+        //      (?:
+        //          (?: (\d+) [*x] ) ?  # left multiplier
+        //          (\d*)               # number of dice
+        //          d (?:               # faces
+        //              (\d*)           # number of faces
+        //          |   f               # fudge dice
+        //          |   \{ [+-]?\d+ (?: : \d+ )? (?: , [+-]?\d+ (?: : \d+ )? ) * \}
+        //                              # custom faces, with optional weights
+        //          )
+        //          (?: r\d+ ) ?        # reroll this or lower (not custom)
+        //          (?: ! (>=\d+)? ) ?  # explode on max or this or higher
+        //          (?: [kd][hl]\d+ ) ? # keep or drop highest or lowest
+        //          (?: [*x] (\d+) ) ?  # right multiplier
+        //      |
+        //          (\d+)               # fixed modifier
+        //      )
+        //      (?: / (\d+) ) ?         # divisor
+
+        dice_scanner scan(str);
+
+        if (scan.peek() == '\0')
+            return;
+
+        while (scan.peek() != '\0') {
+
+            auto sign = 1;
+            auto c = scan.peek();
+
+            if (c == '+' || c == '-') {
+                sign = c == '-' ? -1 : 1;
+                scan.next();
+            }
+
+            bool has_number = scan.at_digit();
+            int number = scan.parse_integer(1);
+            int faces = 0;
+            int factor = sign;
+            int keep = 0;
+            bool lowest = false;
+            int reroll = 0;
+            int explode = 0;
+            bool dice = false;
+            std::vector<std::pair<int, int>> custom;
+            c = scan.peek();
+
+            if (c == '*' || c == 'x') {
+                if (! has_number)
+                    scan.fail();
+                scan.next();
+                factor *= number;
+                number = scan.parse_integer(1);
+                c = scan.peek();
+                if (c != 'd')
+                    scan.fail();
+            }
+
+            if (c == 'd') {
+                scan.next();
+                dice = true;
+                c = scan.peek();
+                if (c == 'f') {
+                    scan.next();
+                    custom = {{-1, 1}, {0, 1}, {1, 1}};
+                } else if (c == '{') {
+                    do {
+                        scan.next();
+                        int value = scan.parse_signed();
+                        int weight = 1;
+                        if (scan.peek() == ':') {
+                            scan.next();
+                            weight = scan.parse_required();
+                            if (weight == 0)
+                                scan.fail();
+                        }
+                        custom.push_back({value, weight});
+                    } while (scan.peek() == ',');
+                    if (scan.peek() != '}')
+                        scan.fail();
+                    scan.next();
+                } else {
+                    faces = scan.parse_integer(6);
+                }
+                c = scan.peek();
+                if (! custom.empty() && (c == 'r' || c == '!' || c == 'k' || c == 'd'))
+                    scan.fail();
+                if (c == 'r') {
+                    scan.next();
+                    reroll = scan.parse_required();
+                    if (reroll > 0 && reroll >= faces)
+                        scan.fail();
+                    c = scan.peek();
+                }
+                if (c == '!') {
+                    scan.next();
+                    explode = faces;
+                    if (scan.peek() == '>') {
+                        scan.next();
+                        if (scan.peek() != '=')
+                            scan.fail();
+                        scan.next();
+                        explode = scan.parse_required();
+                    }
+                    if (explode <= reroll + 1 || explode > faces)
+                        scan.fail();
+                    c = scan.peek();
+                }
+                if (c == 'k' || c == 'd') {
+                    bool drop = c == 'd';
+                    scan.next();
+                    c = scan.peek();
+                    if (c != 'h' && c != 'l')
+                        scan.fail();
+                    scan.next();
+                    lowest = (c == 'l') != drop;
+                    keep = scan.parse_required();
+                    if (drop)
+                        keep = number - keep;
+                    if (keep <= 0 || keep > number || explode != 0)
+                        scan.fail();
+                    c = scan.peek();
+                }
+                if (c == '*' || c == 'x') {
+                    scan.next();
+                    factor *= scan.parse_required();
+                }
+            } else if (! has_number) {
+                scan.fail();
+            }
 
-                auto factor1 = parse_integer(std::string(match[2]), 1);
-                auto n_dice = parse_integer(std::string(match[3]), 1);
-                auto n_faces = parse_integer(std::string(match[4]), 6);
-                auto factor2 = parse_integer(std::string(match[5]), 1);
-                insert(n_dice, n_faces, Rational(sign * factor1 * factor2, divisor));
+            int divisor = 1;
 
+            if (scan.peek() == '/') {
+                scan.next();
+                divisor = scan.parse_required();
             }
 
-            pos = match.endpos();
+            if (! custom.empty())
+                insert(number, custom, Rational(factor, divisor));
+            else if (dice)
+                insert(number, faces, Rational(factor, divisor), keep, lowest, reroll, explode);
+            else
+                add_ += Rational(factor * number, divisor);
+
+            c = scan.peek();
+
+            if (c != '\0' && c != '+' && c != '-')
+                scan.fail();
 
         }
 
@@ -73,60 +609,78 @@ namespace RS::Game {
 
     }
 
+    // If the table has already been built, the arithmetic operators derive
+    // the new one from it: a shift or positive scaling leaves the counts
+    // unchanged, a negative scaling reverses them, and adding another set
+    // of dice needs one extra convolution. Only a shift or positive scaling
+    // reuses a table that is too large to count exactly. Adding dice only
+    // reuses the tables if both have already been built, and the combined
+    // total can still be counted; otherwise the new table is left to be
+    // built on first use, like any other.
+
     Dice Dice::operator-() const {
+        auto table = built_table();
+        if (table && ! table->exact())
+            table.reset();
         Dice d = *this;
         for (auto& g: d.groups_)
             g.factor = - g.factor;
         d.add_ = - d.add_;
         d.modified();
+        if (table)
+            d.set_table(finish_table(expand_table(*table, 1, true)));
         return d;
     }
 
     Dice& Dice::operator+=(const Dice& rhs) {
         Dice d = *this;
         for (auto& g: rhs.groups_)
-            d.insert(g.number, g.one_dice.max(), g.factor);
+            d.insert(g);
         d.add_ += rhs.add_;
         d.modified();
+        if (auto data = combine_tables(*this, rhs, false, d.step_))
+            d.set_table(data);
         *this = std::move(d);
         return *this;
     }
 
     Dice& Dice::operator+=(const Rational& b) {
+        auto table = built_table();
         add_ += b;
         modified();
+        if (table)
+            set_table(table);
         return *this;
     }
 
     Dice& Dice::operator+=(int b) {
-        add_ += b;
-        modified();
-        return *this;
+        return *this += Rational(b);
     }
 
     Dice& Dice::operator-=(const Dice& rhs) {
         Dice d = *this;
-        for (auto& g: rhs.groups_)
-            d.insert(g.number, g.one_dice.max(), - g.factor);
+        for (auto g: rhs.groups_) {
+            g.factor = - g.factor;
+            d.insert(g);
+        }
         d.add_ -= rhs.add_;
         d.modified();
+        if (auto data = combine_tables(*this, rhs, true, d.step_))
+            d.set_table(data);
         *this = std::move(d);
         return *this;
     }
 
     Dice& Dice::operator-=(const Rational& b) {
-        add_ -= b;
-        modified();
-        return *this;
+        return *this += - b;
     }
 
     Dice& Dice::operator-=(int b) {
-        add_ -= b;
-        modified();
-        return *this;
+        return *this += Rational(- b);
     }
 
     Dice& Dice::operator*=(const Rational& rhs) {
+        auto table = built_table();
         if (rhs) {
             for (auto& g: groups_)
                 g.factor *= rhs;
@@ -136,66 +690,329 @@ namespace RS::Game {
             add_ = 0;
         }
         modified();
+        if (table && rhs > 0)
+            set_table(table);
+        else if (table && rhs < 0 && table->exact())
+            set_table(finish_table(expand_table(*table, 1, true)));
         return *this;
     }
 
-    Rational Dice::mean() const noexcept {
-        Rational sum = add_;
-        for (auto& g: groups_)
-            sum += Rational(g.number * (g.one_dice.max() + 1)) * g.factor / Rational(2);
-        return sum;
+    Rational Dice::mean() const {
+        auto m = check_moments();
+        return m ? m->mean : add_;
     }
 
-    Rational Dice::variance() const noexcept {
-        Rational sum;
-        for (auto& g: groups_)
-            sum += Rational(g.number * (g.one_dice.max() * g.one_dice.max() - 1)) * g.factor * g.factor / Rational(12);
-        return sum;
+    Rational Dice::variance() const {
+        auto m = check_moments();
+        return m ? m->variance : Rational(0);
     }
 
-    double Dice::sd() const noexcept {
+    double Dice::sd() const {
         using std::sqrt;
         return sqrt(double(variance()));
     }
 
+    const Dice::moments_info* Dice::check_moments() const {
+
+        // Keep groups and exploding dice need a pass over the group's
+        // distribution, so the moments are found once per expression, on
+        // first use
+
+        if (! moments_)
+            return nullptr;
+
+        std::call_once(moments_->once, [this] { make_moments(moments_->mean, moments_->variance); });
+
+        return moments_.get();
+
+    }
+
+    void Dice::make_moments(Rational& mean, Rational& variance) const {
+
+        // Groups whose exact moments can't be found contribute a double
+        // precision approximation instead, and the totals are then rounded
+        // to the nearest representable fractions
+
+        Rational exact_mean = add_;
+        Rational exact_variance;
+        double real_mean = 0;
+        double real_variance = 0;
+        bool exact = true;
+
+        for (auto& g: groups_) {
+            Rational m, v;
+            if (group_moments(g, m, v)) {
+                exact_mean += m * g.factor;
+                exact_variance += v * g.factor * g.factor;
+            } else {
+                double rm, rv;
+                approx_moments(g, rm, rv);
+                real_mean += rm * double(g.factor);
+                real_variance += rv * double(g.factor) * double(g.factor);
+                exact = false;
+            }
+        }
+
+        if (exact) {
+            mean = exact_mean;
+            variance = exact_variance;
+        } else {
+            mean = nearest_rational(double(exact_mean) + real_mean);
+            variance = nearest_rational(double(exact_variance) + real_variance);
+        }
+
+    }
+
     Rational Dice::pdf(const Rational& x) const {
-        if (! check_table())
+        auto table = check_table();
+        if (! table)
             return 0;
-        auto it = info_->table.find(x);
-        if (it == info_->table.end())
+        auto k = (x - min_) / step_;
+        if (k.den() != 1 || k < 0 || k.num() >= int(table->size()))
             return 0;
         else
-            return it->second.pdf;
+            return table->pdf_at<Rational>(k.num());
     }
 
     Rational Dice::cdf(const Rational& x) const {
-        if (! check_table())
+        auto table = check_table();
+        if (! table)
             return 0;
-        auto it = info_->table.lower_bound(x);
-        if (it == info_->table.end())
-            return 1;
-        else if (it->first == x)
-            return it->second.cdf;
-        else if (it == info_->table.begin())
+        auto k = ((x - min_) / step_).floor();
+        if (k < 0)
             return 0;
+        else if (k >= int(table->size()))
+            return 1;
         else
-            return std::prev(it)->second.cdf;
+            return table->cdf_at<Rational>(k);
     }
 
     Rational Dice::ccdf(const Rational& x) const {
-        if (! check_table())
+        auto table = check_table();
+        if (! table)
             return 0;
-        auto it = info_->table.lower_bound(x);
-        if (it == info_->table.end())
+        auto k = - (- (x - min_) / step_).floor();
+        if (k <= 0)
+            return 1;
+        else if (k >= int(table->size()))
             return 0;
         else
-            return it->second.ccdf;
+            return table->ccdf_at<Rational>(k);
     }
 
     Rational Dice::interval(const Rational& x, const Rational& y) const {
         return cdf(y) - cdf(x - 1);
     }
 
+    double Dice::approx_pdf(const Rational& x) const {
+        auto approx = check_approx();
+        if (! approx)
+            return 0;
+        auto k = (x - min_) / step_;
+        if (k.den() != 1 || k < 0 || x > max_)
+            return 0;
+        if (! approx->pdf.empty())
+            return approx->pdf[k.num()];
+        double z = (double(x) - approx->mean) / approx->sd;
+        return double(step_) / (approx->sd * std::sqrt(2 * pi)) * std::exp(- z * z / 2);
+    }
+
+    double Dice::approx_cdf(const Rational& x) const {
+        auto approx = check_approx();
+        if (! approx)
+            return 0;
+        auto k = ((x - min_) / step_).floor();
+        if (k < 0)
+            return 0;
+        if (x >= max_)
+            return 1;
+        if (! approx->cdf.empty())
+            return approx->cdf[k];
+        double z = (double(min_ + step_ * k) + double(step_) / 2 - approx->mean) / approx->sd;
+        return std::erfc(- z / std::sqrt(2.0)) / 2;
+    }
+
+    double Dice::approx_ccdf(const Rational& x) const {
+        auto approx = check_approx();
+        if (! approx)
+            return 0;
+        auto k = - (- (x - min_) / step_).floor();
+        if (k <= 0)
+            return 1;
+        if (x > max_)
+            return 0;
+        if (! approx->ccdf.empty())
+            return approx->ccdf[k];
+        double z = (double(min_ + step_ * k) - double(step_) / 2 - approx->mean) / approx->sd;
+        return std::erfc(z / std::sqrt(2.0)) / 2;
+    }
+
+    void Dice::set_normal_limit(size_t n) {
+        normal_limit_ = n;
+        if (approx_)
+            approx_ = std::make_shared<approx_info>();
+    }
+
+    Rational Dice::quantile(const Rational& p) const {
+        Rational x;
+        quantiles(&p, &x, 1);
+        return x;
+    }
+
+    void Dice::quantiles(const Rational* p, Rational* out, size_t n) const {
+
+        // The quantile is the lowest result whose CDF count is at least
+        // ceil(p*total). Splitting total=q*den+r keeps the calculation in
+        // range: p*total = num*q + num*r/den, with num*q<=total and
+        // num*r<den^2. Without exact counts, the CDF is searched directly.
+
+        auto table = check_table();
+
+        for (size_t i = 0; i < n; ++i) {
+            if (p[i] < 0 || p[i] > 1)
+                throw std::invalid_argument("Invalid probability: " + p[i].str());
+            if (! table) {
+                out[i] = min_;
+                continue;
+            }
+            std::ptrdiff_t k = 0;
+            if (table->exact()) {
+                count_type num = std::uint64_t(p[i].num());
+                count_type den = std::uint64_t(p[i].den());
+                auto q = table->total / den;
+                auto r = table->total % den;
+                auto needed = num * q + (num * r + den - 1) / den;
+                k = std::lower_bound(table->cdf.begin(), table->cdf.end(), needed) - table->cdf.begin();
+            } else {
+                k = std::lower_bound(table->real_cdf.begin(), table->real_cdf.end(), double(p[i])) - table->real_cdf.begin();
+            }
+            out[i] = min_ + step_ * Rational(int(k));
+        }
+
+    }
+
+    std::map<Rational, Rational> Dice::table() const {
+        std::map<Rational, Rational> map;
+        auto table = check_table();
+        if (! table)
+            return map;
+        auto x = min_;
+        for (size_t i = 0; i < table->size(); ++i) {
+            auto p = table->pdf_at<Rational>(i);
+            if (p != 0)
+                map.insert(map.end(), {x, p});
+            x += step_;
+        }
+        return map;
+    }
+
+    Dice::comparison Dice::compare(const Dice& a, const Dice& b) {
+
+        // Merge the two sorted tables in one pass, after scaling both
+        // lattices to a common integer grid. For each result of a, the
+        // probabilities for b are taken from the cumulative table just below
+        // the first result of b that is not less than it. Counts are used if
+        // both tables have them and the product of their totals fits,
+        // otherwise double precision probabilities.
+
+        static const auto unit = table_data::unit();
+
+        auto ta = a.check_table();
+        auto tb = b.check_table();
+
+        if (! ta)
+            ta = &unit;
+        if (! tb)
+            tb = &unit;
+
+        long long den = std::lcm(std::lcm(a.min_.den(), a.step_.den()), std::lcm(b.min_.den(), b.step_.den()));
+        auto grid = [den] (const Rational& x) { return (long long)(x.num()) * (den / x.den()); };
+        auto a_min = grid(a.min_);
+        auto a_step = grid(a.step_);
+        auto b_min = grid(b.min_);
+        auto b_step = grid(b.step_);
+        auto na = ta->size();
+        auto nb = tb->size();
+
+        auto merge = [&] (auto pdf_a, auto pdf_b, auto cdf_b, auto& win, auto& tie) {
+            size_t j = 0;
+            for (size_t i = 0; i < na; ++i) {
+                auto p = pdf_a(i);
+                if (p == 0)
+                    continue;
+                auto x = a_min + (long long)(i) * a_step;
+                while (j < nb && b_min + (long long)(j) * b_step < x)
+                    ++j;
+                if (j > 0)
+                    win += p * cdf_b(j - 1);
+                if (j < nb && b_min + (long long)(j) * b_step == x)
+                    tie += p * pdf_b(j);
+            }
+        };
+
+        count_type total = ta->total;
+
+        if (ta->exact() && tb->exact() && try_multiply(total, tb->total)) {
+            count_type win = 0;
+            count_type tie = 0;
+            merge([ta] (size_t i) { return ta->pdf[i]; }, [tb] (size_t j) { return tb->pdf[j]; },
+                [tb] (size_t j) { return tb->cdf[j]; }, win, tie);
+            return {make_probability(win, total), make_probability(tie, total), make_probability(total - win - tie, total)};
+        }
+
+        double win = 0;
+        double tie = 0;
+        merge([ta] (size_t i) { return ta->pdf_at<double>(i); }, [tb] (size_t j) { return tb->pdf_at<double>(j); },
+            [tb] (size_t j) { return tb->cdf_at<double>(j); }, win, tie);
+
+        return {nearest_rational(win), nearest_rational(tie), nearest_rational(std::max(1 - win - tie, 0.0))};
+
+    }
+
+    std::vector<Dice::comparison> Dice::compare(const Dice& a, const std::vector<Dice>& b) {
+        std::vector<comparison> result;
+        result.reserve(b.size());
+        for (auto& d: b)
+            result.push_back(compare(a, d));
+        return result;
+    }
+
+    template <typename T>
+    Dice::distribution_arrays<T> Dice::arrays() const {
+
+        // One pass over the lattice table, including any results with zero
+        // probability, so the values are evenly spaced
+
+        static const auto unit = table_data::unit();
+
+        auto table = check_table();
+
+        if (! table)
+            table = &unit;
+
+        size_t n = table->size();
+        distribution_arrays<T> result;
+        result.values.reserve(n);
+        result.pdf.reserve(n);
+        result.cdf.reserve(n);
+        result.ccdf.reserve(n);
+        auto x = min_;
+
+        for (size_t i = 0; i < n; ++i) {
+            result.values.push_back(static_cast<T>(x));
+            result.pdf.push_back(table->pdf_at<T>(i));
+            result.cdf.push_back(table->cdf_at<T>(i));
+            result.ccdf.push_back(table->ccdf_at<T>(i));
+            x += step_;
+        }
+
+        return result;
+
+    }
+
+    template Dice::distribution_arrays<Rational> Dice::arrays<Rational>() const;
+    template Dice::distribution_arrays<double> Dice::arrays<double>() const;
+
     std::string Dice::str() const {
 
         std::string text;
@@ -204,7 +1021,32 @@ namespace RS::Game {
             text += g.factor.sign() == -1 ? '-' : '+';
             if (g.number > 1)
                 text += std::to_string(g.number);
-            text += 'd' + std::to_string(g.one_dice.max());
+            if (g.faces) {
+                auto& faces = *g.faces;
+                if (faces.values == std::vector<int>{-1, 0, 1} && faces.total == 3) {
+                    text += "dF";
+                } else {
+                    char delimiter = '{';
+                    text += 'd';
+                    for (size_t i = 0; i < faces.values.size(); ++i) {
+                        text += delimiter + std::to_string(faces.values[i]);
+                        if (faces.weights[i] > 1)
+                            text += ':' + std::to_string(faces.weights[i]);
+                        delimiter = ',';
+                    }
+                    text += '}';
+                }
+            } else {
+                text += 'd' + std::to_string(g.one_dice.max());
+            }
+            if (g.one_dice.min() > 1 && ! g.faces)
+                text += 'r' + std::to_string(g.one_dice.min() - 1);
+            if (g.explode == g.one_dice.max())
+                text += '!';
+            else if (g.explode != 0)
+                text += "!>=" + std::to_string(g.explode);
+            if (g.keep != 0)
+                text += (g.lowest ? "kl" : "kh") + std::to_string(g.keep);
             auto n = std::abs(g.factor.num());
             if (n > 1)
                 text += '*' + std::to_string(n);
@@ -227,127 +1069,1478 @@ namespace RS::Game {
 
     }
 
-    bool Dice::check_table() const {
+    size_t Dice::cache_hits() noexcept {
+        return table_cache::get().hits();
+    }
 
-        if (! info_)
-            return false;
+    size_t Dice::cache_misses() noexcept {
+        return table_cache::get().misses();
+    }
 
-        auto lock = std::unique_lock(info_->mutex);
+    size_t Dice::cache_size() noexcept {
+        return table_cache::get().size();
+    }
 
-        if (! info_->table.empty())
-            return true;
+    void Dice::clear_cache() noexcept {
+        table_cache::get().clear();
+    }
 
-        int n = int(groups_.size());
-        std::vector<pdf_table> subtables(n);
-        std::transform(groups_.begin(), groups_.end(), subtables.begin(), make_table);
-        std::vector<pdf_table::const_iterator> iterators(n);
-        std::transform(subtables.begin(), subtables.end(), iterators.begin(), [] (auto& sub) { return sub.begin(); });
+    void Dice::set_cache_limit(size_t n) noexcept {
+        table_cache::get().set_limit(n);
+    }
 
-        for (;;) {
+    size_t Dice::parallel_threshold() noexcept {
+        return parallel_limit.load(std::memory_order_relaxed);
+    }
 
-            auto x = add_;
-            Rational p = 1;
+    void Dice::set_parallel_threshold(size_t n) noexcept {
+        parallel_limit.store(n, std::memory_order_relaxed);
+    }
 
-            for (auto i: iterators) {
-                x += i->first;
-                p *= i->second;
-            }
+    std::shared_ptr<const Dice::table_data> Dice::built_table() const noexcept {
+        if (info_ && info_->ready.load(std::memory_order_acquire))
+            return info_->data;
+        else
+            return {};
+    }
 
-            info_->table[x].pdf += p;
+    const Dice::approx_data* Dice::check_approx() const {
+        if (! approx_)
+            return nullptr;
+        std::call_once(approx_->once, [this] { approx_->data = make_approx(); });
+        return approx_->data.get();
+    }
 
-            int i = n - 1;
-            for (; i >= 0; --i) {
-                ++iterators[i];
-                if (iterators[i] != subtables[i].end())
-                    break;
-                iterators[i] = subtables[i].begin();
-            }
-            if (i == -1)
-                break;
+    std::shared_ptr<const Dice::approx_data> Dice::make_approx() const {
+
+        // Use the normal approximation when the table would be too big,
+        // otherwise convolve the group distributions in double precision.
+        // A single point never needs either.
 
+        auto data = std::make_shared<approx_data>();
+        auto size = size_t(((max_ - min_) / step_).num()) + 1;
+
+        if (size > 1 && size > normal_limit_) {
+            data->mean = double(mean());
+            data->sd = sd();
+            return data;
         }
 
-        Rational cdf = 0;
-        auto j = info_->table.end();
+        std::vector<double> pdf = {1};
 
-        for (auto& [x,ps]: info_->table)
-            (--j)->second.ccdf = ps.cdf = cdf = cdf + ps.pdf;
+        for (auto& g: groups_)
+            pdf = convolve_real(pdf, approx_group(g));
 
-        info_->table.begin()->second.ccdf = std::prev(info_->table.end())->second.cdf = 1;
+        // Rounding error can leave the total slightly away from 1
 
-        return true;
+        double total = std::accumulate(pdf.begin(), pdf.end(), 0.0);
 
-    }
+        for (auto& p: pdf)
+            p /= total;
 
-    void Dice::insert(int n, int faces, const Rational& factor) {
+        data->cdf.resize(size);
+        data->ccdf.resize(size);
+        std::partial_sum(pdf.begin(), pdf.end(), data->cdf.begin());
+        std::partial_sum(pdf.rbegin(), pdf.rend(), data->ccdf.rbegin());
 
-        static const auto match_terms = [] (const dice_group& g1, const dice_group& g2) noexcept {
-            return g1.one_dice.max() == g2.one_dice.max() && g1.factor == g2.factor;
-        };
+        for (auto& p: data->cdf)
+            p = std::min(p, 1.0);
+        for (auto& p: data->ccdf)
+            p = std::min(p, 1.0);
 
-        static const auto sort_terms = [] (const dice_group& g1, const dice_group& g2) noexcept {
-            return g1.one_dice.max() == g2.one_dice.max() ? g1.factor < g2.factor : g1.one_dice.max() > g2.one_dice.max();
-        };
+        data->pdf = std::move(pdf);
+
+        return data;
+
+    }
+
+    const Dice::table_data* Dice::check_table() const {
+
+        // The table is built once, on first use, and never modified after
+        // that, so call_once is the only synchronization needed; after the
+        // first call it costs only an atomic load
+
+        if (! info_)
+            return nullptr;
+
+        std::call_once(info_->once, [this] {
+            if (! info_->data) {
+                auto& cache = table_cache::get();
+                std::string key;
+                if (cache.enabled()) {
+                    key = str();
+                    info_->data = cache.find(key);
+                }
+                if (! info_->data) {
+                    info_->data = make_data();
+                    if (! key.empty())
+                        cache.insert(key, info_->data);
+                }
+            }
+            info_->ready.store(true, std::memory_order_release);
+        });
+
+        return info_->data.get();
+
+    }
+
+    std::shared_ptr<const Dice::table_data> Dice::combine_tables(const Dice& lhs, const Dice& rhs, bool negate,
+            const Rational& step) {
+
+        // Returns null if the table can't be derived from the existing ones.
+        // A set of dice with no groups has a trivial table, whether or not
+        // it has been built.
+
+        static const auto unit = table_data::unit();
+
+        auto lhs_table = lhs.built_table();
+        auto rhs_table = rhs.built_table();
+
+        if ((! lhs_table && ! lhs.groups_.empty()) || (! rhs_table && ! rhs.groups_.empty()))
+            return {};
+
+        auto& t1 = lhs.groups_.empty() ? unit : *lhs_table;
+        auto& t2 = rhs.groups_.empty() ? unit : *rhs_table;
+        auto total = t1.total;
+
+        if (! t1.exact() || ! t2.exact() || ! try_multiply(total, t2.total))
+            return {};
+
+        return finish_table(convolve(expand_table(t1, (lhs.step_ / step).num(), false),
+            expand_table(t2, (rhs.step_ / step).num(), negate)));
+
+    }
+
+    Dice::count_table Dice::expand_table(const table_data& data, size_t stride, bool reverse) {
+        count_table table;
+        table.counts.assign(stride * (data.pdf.size() - 1) + 1, 0);
+        table.total = data.total;
+        for (size_t i = 0; i < data.pdf.size(); ++i)
+            table.counts[i * stride] = data.pdf[i];
+        if (reverse)
+            std::reverse(table.counts.begin(), table.counts.end());
+        return table;
+    }
+
+    std::shared_ptr<const Dice::table_data> Dice::finish_table(count_table&& sums) {
+        auto data = std::make_shared<table_data>();
+        data->cdf.resize(sums.counts.size());
+        std::partial_sum(sums.counts.begin(), sums.counts.end(), data->cdf.begin());
+        data->pdf = std::move(sums.counts);
+        data->total = sums.total;
+        return data;
+    }
+
+    std::shared_ptr<const Dice::table_data> Dice::finish_real_table(std::vector<double>&& pdf) {
+
+        // Rounding error can leave the total slightly away from 1, so the
+        // probabilities are normalized, and the cumulative tables are forced
+        // to reach exactly 1 at their ends
+
+        auto data = std::make_shared<table_data>();
+        double total = std::accumulate(pdf.begin(), pdf.end(), 0.0);
+
+        for (auto& p: pdf)
+            p /= total;
+
+        data->real_cdf.resize(pdf.size());
+        data->real_ccdf.resize(pdf.size());
+        std::partial_sum(pdf.begin(), pdf.end(), data->real_cdf.begin());
+        std::partial_sum(pdf.rbegin(), pdf.rend(), data->real_ccdf.rbegin());
+
+        for (auto& p: data->real_cdf)
+            p = std::min(p, 1.0);
+        for (auto& p: data->real_ccdf)
+            p = std::min(p, 1.0);
+
+        data->real_cdf.back() = 1;
+        data->real_ccdf.front() = 1;
+        data->real_pdf = std::move(pdf);
+
+        return data;
+
+    }
+
+    std::shared_ptr<const Dice::table_data> Dice::make_data() const {
+
+        // Every possible result lies on the lattice min+k*step, where step
+        // is the greatest common divisor of the group factors, so the table
+        // is a dense array of counts indexed by k. If the number of possible
+        // outcomes is too large to count, the table holds normalized double
+        // precision probabilities instead.
+
+        auto size = size_t(((max_ - min_) / step_).num()) + 1;
+        auto threshold = parallel_threshold();
+        count_type total = 1;
+
+        for (auto& g: groups_) {
+            count_type n;
+            if (! group_total(g, n) || ! try_multiply(total, n)) {
+                std::vector<double> pdf = {1};
+                for (auto& h: groups_)
+                    pdf = convolve_real(pdf, approx_group(h));
+                return finish_real_table(std::move(pdf));
+            }
+        }
+
+        if (groups_.size() < 2 || threshold == 0 || size < threshold) {
+            count_table sums;
+            for (auto& g: groups_)
+                sums = convolve(sums, make_table(g));
+            return finish_table(std::move(sums));
+        }
+
+        // For large tables, build the group tables concurrently, then
+        // combine them pairwise in a balanced tree. The convolutions at each
+        // level are independent; the last one is the largest, so it is split
+        // across threads instead. The counts are exact, so the result does
+        // not depend on the order of combination.
+
+        auto threads = Detail::hardware_threads();
+        std::vector<count_table> tables(groups_.size());
+
+        Detail::parallel_for(tables.size(), threads, [this,&tables] (size_t i, size_t /*worker*/) {
+            tables[i] = make_table(groups_[i]);
+        });
+
+        while (tables.size() > 2) {
+
+            std::vector<count_table> next(tables.size() / 2);
+
+            Detail::parallel_for(next.size(), threads, [&tables,&next] (size_t i, size_t /*worker*/) {
+                next[i] = convolve(tables[2 * i], tables[2 * i + 1]);
+            });
+
+            if (tables.size() % 2 != 0)
+                next.push_back(std::move(tables.back()));
+
+            tables = std::move(next);
 
-        if (n < 0 || faces < 0)
+        }
+
+        return finish_table(convolve_parallel(tables[0], tables[1]));
+
+    }
+
+    void Dice::insert(int n, int faces, const Rational& factor, int keep, bool lowest, int reroll, int explode) {
+
+        if (n < 0 || faces < 0 || keep < 0 || keep > n || reroll < 0)
             throw std::invalid_argument("Invalid dice");
 
-        if (n > 0 && faces > 0 && factor != 0) {
-            dice_group g;
-            g.number = n;
-            g.one_dice = distribution_type(1, faces);
-            g.factor = factor;
-            auto it = std::lower_bound(groups_.begin(), groups_.end(), g, sort_terms);
-            if (it != groups_.end() && match_terms(*it, g))
-                it->number += g.number;
-            else
-                groups_.insert(it, g);
+        if (n == 0 || faces == 0 || factor == 0)
+            return;
+
+        if (reroll >= faces || (explode != 0 && (explode <= reroll + 1 || explode > faces || keep != 0)))
+            throw std::invalid_argument("Invalid dice");
+
+        dice_group g;
+        g.number = n;
+        g.one_dice = distribution_type(reroll + 1, faces);
+        g.factor = factor;
+
+        if (keep < n) {
+            g.keep = keep;
+            g.lowest = lowest;
+        }
+
+        if (explode != 0) {
+
+            // Cap the explosions where the chance of going any further
+            // becomes negligible (see explode_tail)
+
+            g.explode = explode;
+            double p = double(faces - explode + 1) / double(faces - reroll);
+            for (double tail = 1; tail > explode_tail; tail *= p)
+                ++g.depth;
+
+        }
+
+        insert(g);
+
+    }
+
+    void Dice::insert(int n, std::vector<std::pair<int, int>> faces, const Rational& factor) {
+
+        // Faces are (value,weight) pairs, in any order, possibly repeated
+
+        if (n < 0 || faces.empty())
+            throw std::invalid_argument("Invalid dice");
+
+        std::sort(faces.begin(), faces.end());
+        auto set = std::make_shared<face_set>();
+        long long total = 0;
+
+        for (auto& [value, weight]: faces) {
+            total += weight;
+            if (weight <= 0 || total > std::numeric_limits<int>::max())
+                throw std::invalid_argument("Invalid dice");
+            if (set->values.empty() || set->values.back() != value) {
+                set->values.push_back(value);
+                set->weights.push_back(0);
+            }
+            set->weights.back() += weight;
+        }
+
+        int divisor = 0;
+
+        for (auto w: set->weights)
+            divisor = std::gcd(divisor, w);
+        for (auto& w: set->weights)
+            w /= divisor;
+
+        set->total = int(total / divisor);
+
+        if (n == 0 || factor == 0)
+            return;
+
+        int m = int(set->values.size());
+        int a = set->values.front();
+        int f = set->values.back();
+
+        if (m == 1) {
+            add_ += Rational(n * a) * factor;
+            return;
+        }
+
+        // Equally likely consecutive faces are an ordinary die, with low
+        // rolls rerolled if necessary, as long as they start from 1 or more
+
+        if (a >= 1 && f - a + 1 == m && set->total == m) {
+            insert(n, f, factor, 0, false, a - 1);
+            return;
+        }
+
+        // Walker's alias method, using Vose's algorithm to build the table,
+        // in exact integer arithmetic with the total weight as the unit
+
+        std::vector<long long> scaled(m);
+        std::vector<int> small, large;
+        set->threshold.assign(m, set->total);
+        set->alias.resize(m);
+        set->index = distribution_type(0, m - 1);
+        set->draw = distribution_type(0, set->total - 1);
+
+        for (int i = 0; i < m; ++i) {
+            scaled[i] = (long long)(set->weights[i]) * m;
+            set->alias[i] = i;
+            (scaled[i] < set->total ? small : large).push_back(i);
+        }
+
+        while (! small.empty() && ! large.empty()) {
+            int i = small.back();
+            int j = large.back();
+            small.pop_back();
+            large.pop_back();
+            set->threshold[i] = int(scaled[i]);
+            set->alias[i] = j;
+            scaled[j] -= set->total - scaled[i];
+            (scaled[j] < set->total ? small : large).push_back(j);
         }
 
+        dice_group g;
+        g.number = n;
+        g.one_dice = distribution_type(a, f);
+        g.faces = set;
+        g.factor = factor;
+        insert(g);
+
+    }
+
+    void Dice::insert(const dice_group& g) {
+
+        static const std::vector<int> no_faces;
+
+        static const auto face_key = [] (const dice_group& g) noexcept {
+            return std::tie(g.faces ? g.faces->values : no_faces, g.faces ? g.faces->weights : no_faces);
+        };
+
+        static const auto match_terms = [] (const dice_group& g1, const dice_group& g2) noexcept {
+            return g1.one_dice.min() == g2.one_dice.min() && g1.one_dice.max() == g2.one_dice.max()
+                && g1.factor == g2.factor && g1.keep == 0 && g2.keep == 0 && g1.explode == g2.explode
+                && face_key(g1) == face_key(g2);
+        };
+
+        static const auto sort_terms = [] (const dice_group& g1, const dice_group& g2) noexcept {
+            auto t1 = std::make_tuple(- g1.one_dice.max(), g1.factor, g1.one_dice.min(), g1.explode, g1.keep, g1.lowest);
+            auto t2 = std::make_tuple(- g2.one_dice.max(), g2.factor, g2.one_dice.min(), g2.explode, g2.keep, g2.lowest);
+            if (t1 != t2)
+                return t1 < t2;
+            else
+                return face_key(g1) < face_key(g2);
+        };
+
+        auto it = std::lower_bound(groups_.begin(), groups_.end(), g, sort_terms);
+
+        if (it != groups_.end() && match_terms(*it, g))
+            it->number += g.number;
+        else
+            groups_.insert(it, g);
+
     }
 
     void Dice::modified() {
 
         info_ = std::make_shared<table_info>();
+        approx_ = std::make_shared<approx_info>();
+        moments_ = std::make_shared<moments_info>();
         min_ = max_ = add_;
+        step_ = 1;
+
+        if (! groups_.empty()) {
+            int num = 0;
+            int den = 1;
+            for (auto& g: groups_) {
+                num = std::gcd(num, g.factor.num());
+                den = std::lcm(den, g.factor.den());
+            }
+            step_ = Rational(num, den);
+            for (auto& g: groups_)
+                g.multiple = (g.factor / step_).num();
+        }
 
         for (auto& g: groups_) {
             if (g.factor > 0) {
-                min_ += Rational(g.number) * g.factor;
-                max_ += Rational(g.number * g.one_dice.max()) * g.factor;
+                min_ += Rational(g.low()) * g.factor;
+                max_ += Rational(g.high()) * g.factor;
             } else {
-                min_ += Rational(g.number * g.one_dice.max()) * g.factor;
-                max_ += Rational(g.number) * g.factor;
+                min_ += Rational(g.high()) * g.factor;
+                max_ += Rational(g.low()) * g.factor;
+            }
+        }
+
+        auto s = std::make_shared<sampler>();
+        s->add = add_;
+        s->step = step_;
+        s->integral = add_.den() == 1 && step_.den() == 1;
+
+        for (auto& g: groups_) {
+            if (g.faces)
+                s->custom.push_back(g);
+            else if (g.explode != 0)
+                s->explode.push_back(g);
+            else if (g.keep != 0)
+                s->keep.push_back(g);
+            else
+                s->uniform.push_back(g);
+        }
+
+        sampler_ = s;
+
+    }
+
+    std::shared_ptr<const Dice::sampler> Dice::null_sampler() {
+        static const auto s = std::make_shared<const sampler>();
+        return s;
+    }
+
+    void Dice::set_table(std::shared_ptr<const table_data> data) {
+        info_->data = std::move(data);
+        info_->ready = true;
+    }
+
+    Dice::count_table Dice::convolve(const count_table& t1, const count_table& t2) {
+
+        // Distribution of the sum of two independent variables. No count
+        // can exceed the product of the totals, which the caller has already
+        // checked.
+
+        count_table table;
+        table.counts.assign(t1.counts.size() + t2.counts.size() - 1, 0);
+        table.total = t1.total * t2.total;
+
+        for (size_t i = 0; i < t1.counts.size(); ++i)
+            if (t1.counts[i] != 0)
+                for (size_t j = 0; j < t2.counts.size(); ++j)
+                    table.counts[i + j] += t1.counts[i] * t2.counts[j];
+
+        return table;
+
+    }
+
+    Dice::count_table Dice::convolve_parallel(const count_table& t1, const count_table& t2) {
+
+        // Each output element is computed as a separate sum, so threads
+        // working on disjoint ranges never touch the same element. Elements
+        // near the middle take the longest, so the work is handed out in
+        // small blocks rather than divided evenly up front.
+
+        static constexpr size_t block_size = 256;
+
+        count_table table;
+        auto n1 = t1.counts.size();
+        auto n2 = t2.counts.size();
+        auto size = n1 + n2 - 1;
+        table.counts.assign(size, 0);
+        table.total = t1.total * t2.total;
+        auto blocks = (size + block_size - 1) / block_size;
+
+        Detail::parallel_for(blocks, Detail::hardware_threads(), [&] (size_t block, size_t /*worker*/) {
+            auto begin = block * block_size;
+            auto end = std::min(begin + block_size, size);
+            for (auto k = begin; k < end; ++k) {
+                auto i = k < n2 ? size_t(0) : k - n2 + 1;
+                auto j = std::min(k + 1, n1);
+                count_type sum = 0;
+                for (; i < j; ++i)
+                    sum += t1.counts[i] * t2.counts[k - i];
+                table.counts[k] = sum;
             }
+        });
+
+        return table;
+
+    }
+
+    Dice::count_table Dice::make_table(const dice_group& group) {
+
+        count_type total = 1;
+        auto counts = group_counts(group, total);
+
+        // Spread the counts out to the common lattice, in ascending order of
+        // the result
+
+        if (group.factor < 0)
+            std::reverse(counts.begin(), counts.end());
+
+        size_t stride = std::abs(group.multiple);
+        count_table table;
+        table.counts.assign(stride * (counts.size() - 1) + 1, 0);
+        table.total = total;
+
+        for (size_t i = 0; i < counts.size(); ++i)
+            table.counts[i * stride] = counts[i];
+
+        return table;
+
+    }
+
+    std::vector<double> Dice::approx_group(const dice_group& group) {
+
+        auto pdf = group_probabilities(group);
+
+        if (group.factor < 0)
+            std::reverse(pdf.begin(), pdf.end());
+
+        size_t stride = std::abs(group.multiple);
+
+        if (stride > 1) {
+            std::vector<double> spread(stride * (pdf.size() - 1) + 1, 0);
+            for (size_t i = 0; i < pdf.size(); ++i)
+                spread[i * stride] = pdf[i];
+            pdf = std::move(spread);
         }
 
+        return pdf;
+
     }
 
-    Dice::pdf_table Dice::make_table(const dice_group& group) {
+    std::vector<Dice::count_type> Dice::group_counts(const dice_group& group, count_type& total) {
+
+        // Returns the number of ways of rolling each total, starting from
+        // the lowest possible total. Every intermediate count is bounded by
+        // the total, w^n for w possible rolls, and the caller has already
+        // checked that this can be counted (see group_total()). Exploding
+        // dice are never counted.
 
-        pdf_table table;
         int n = group.number;
+
+        if (group.faces) {
+
+            // Custom faces: add one die at a time, weighting each face
+
+            auto& faces = *group.faces;
+            int a = faces.values.front();
+            int range = faces.values.back() - a;
+            std::vector<count_type> counts = {1};
+            std::vector<count_type> next;
+            total = 1;
+
+            for (int i = 0; i < n; ++i) {
+                total *= std::uint64_t(faces.total);
+                next.assign(counts.size() + range, 0);
+                for (size_t x = 0; x < counts.size(); ++x)
+                    if (counts[x] != 0)
+                        for (size_t j = 0; j < faces.values.size(); ++j)
+                            next[x + faces.values[j] - a] += counts[x] * faces.weights[j];
+                counts.swap(next);
+            }
+
+            return counts;
+
+        }
+
+        int a = group.one_dice.min();
         int f = group.one_dice.max();
-        int den = integer_power(f, n);
-        int max = f * n;
-        double b = n - 1;
+        int w = f - a + 1;
+        total = 1;
+
+        for (int i = 0; i < n; ++i)
+            total *= std::uint64_t(w);
+
+        if (group.keep == 0) {
+
+            // Add one die at a time, with a sliding window sum over the
+            // previous counts
+
+            std::vector<count_type> counts = {1};
+            std::vector<count_type> next;
+
+            for (int i = 1; i <= n; ++i) {
+                next.assign(counts.size() + w - 1, 0);
+                count_type window = 0;
+                for (size_t j = 0; j < next.size(); ++j) {
+                    if (j < counts.size())
+                        window += counts[j];
+                    if (j >= size_t(w))
+                        window -= counts[j - w];
+                    next[j] = window;
+                }
+                counts.swap(next);
+            }
 
-        for (int i = n; i <= max; ++i) {
+            return counts;
 
-            int num = 0;
-            int sign = 1;
-            double a = i - 1;
+        }
+
+        // Order statistic DP for keeping the k highest (or lowest) dice.
+        // Visit the face values from the most favoured end, choosing how
+        // many of the remaining dice show each value; since the dice are
+        // visited in order of preference, the first k dice assigned are the
+        // ones kept. The state is (dice assigned, sum of kept dice).
+
+        int k = group.keep;
+        int max_sum = k * f;
+        int width = max_sum + 1;
+        std::vector<count_type> ways(size_t(n + 1) * width, 0);
+        std::vector<count_type> next;
+        ways[0] = 1;
+
+        // Binomial coefficients C(m,r) for m,r<=n; these are bounded by 2^n,
+        // which is no more than the total
+
+        std::vector<count_type> binomial(size_t(n + 1) * (n + 1), 0);
+
+        for (int m = 0; m <= n; ++m) {
+            binomial[m * (n + 1)] = 1;
+            for (int r = 1; r <= m; ++r)
+                binomial[m * (n + 1) + r] = binomial[(m - 1) * (n + 1) + r - 1]
+                    + (r < m ? binomial[(m - 1) * (n + 1) + r] : 0);
+        }
+
+        for (int i = 0; i < w; ++i) {
+            int value = group.lowest ? a + i : f - i;
+            next.assign(ways.size(), 0);
+            for (int j = 0; j <= n; ++j) {
+                for (int sum = 0; sum <= max_sum; ++sum) {
+                    auto count = ways[j * width + sum];
+                    if (count == 0)
+                        continue;
+                    for (int m = 0; j + m <= n; ++m) {
+                        int kept = std::min(m, std::max(k - j, 0));
+                        next[(j + m) * width + sum + kept * value] += count * binomial[(n - j) * (n + 1) + m];
+                    }
+                }
+            }
+            ways.swap(next);
+        }
 
-            for (int j = 0; j < n; ++j, a -= f, sign = - sign)
-                num += sign * int(std::lround(binomial(a, b) * binomial(double(n), double(j))));
+        return std::vector<count_type>(ways.begin() + n * width + k * a, ways.end());
 
-            Rational x = i * group.factor;
-            Rational p(num, den);
-            table.insert({x, p});
+    }
+
+    std::vector<double> Dice::group_probabilities(const dice_group& group) {
+
+        // The same distribution as group_counts, but as probabilities, so
+        // there is no limit on the number of outcomes. Plain, custom, and
+        // exploding dice are handled as powers of the single die
+        // distribution; kept dice need the order statistic DP.
+
+        int n = group.number;
+        int a = group.one_dice.min();
+        int f = group.one_dice.max();
+        int w = f - a + 1;
+
+        if (group.keep == 0) {
+
+            std::vector<double> die;
+
+            if (group.faces) {
+                auto& faces = *group.faces;
+                die.assign(faces.values.back() - faces.values.front() + 1, 0);
+                for (size_t i = 0; i < faces.values.size(); ++i)
+                    die[faces.values[i] - faces.values.front()] = double(faces.weights[i]) / double(faces.total);
+            } else if (group.explode != 0) {
+                int t = group.explode;
+                std::vector<double> chain = {1};
+                std::vector<double> next;
+                die.assign((group.depth + 1) * f + 1, 0);
+                for (int j = 0; j <= group.depth; ++j) {
+                    int last = j < group.depth ? t - 1 : f;
+                    for (size_t x = 0; x < chain.size(); ++x)
+                        for (int v = a; v <= last; ++v)
+                            die[x + v] += chain[x] / w;
+                    if (j == group.depth)
+                        break;
+                    next.assign(chain.size() + f, 0);
+                    for (size_t x = 0; x < chain.size(); ++x)
+                        for (int v = t; v <= f; ++v)
+                            next[x + v] += chain[x] / w;
+                    chain.swap(next);
+                }
+                die.erase(die.begin(), die.begin() + a);
+            } else {
+                die.assign(w, 1.0 / w);
+            }
+
+            return power_real(die, n);
 
         }
 
-        return table;
+        // Visit the face values from the most favoured end, as in
+        // group_counts. Given that the remaining dice all show this value or
+        // something less favoured, the number showing this value is
+        // binomial with p=1/(faces left). Once k dice have been assigned,
+        // the kept sum is final, so those states are moved straight to the
+        // result.
+
+        int k = group.keep;
+        int max_sum = k * f;
+        int width = max_sum + 1;
+        std::vector<double> ways(size_t(k) * width, 0);
+        std::vector<double> next;
+        std::vector<double> result(width, 0);
+        std::vector<double> log_factorial(n + 1, 0);
+        std::vector<double> binomial(n + 1);
+        ways[0] = 1;
+
+        for (int m = 2; m <= n; ++m)
+            log_factorial[m] = log_factorial[m - 1] + std::log(double(m));
+
+        for (int i = 0; i < w; ++i) {
+            int value = group.lowest ? a + i : f - i;
+            double p = 1.0 / (w - i);
+            next.assign(ways.size(), 0);
+            for (int j = 0; j < k; ++j) {
+                int r = n - j;
+                for (int m = 0; m <= r; ++m) {
+                    if (i == w - 1)
+                        binomial[m] = m == r ? 1 : 0;
+                    else
+                        binomial[m] = std::exp(log_factorial[r] - log_factorial[m] - log_factorial[r - m]
+                            + m * std::log(p) + (r - m) * std::log1p(- p));
+                }
+                double rest = 0;
+                for (int m = r; m >= k - j; --m)
+                    rest += binomial[m];
+                for (int sum = 0; sum <= max_sum; ++sum) {
+                    auto prob = ways[j * width + sum];
+                    if (prob == 0)
+                        continue;
+                    for (int m = 0; m < k - j; ++m)
+                        next[(j + m) * width + sum + m * value] += prob * binomial[m];
+                    result[sum + (k - j) * value] += prob * rest;
+                }
+            }
+            ways.swap(next);
+        }
+
+        return std::vector<double>(result.begin() + k * a, result.end());
+
+    }
+
+    bool Dice::group_total(const dice_group& group, count_type& total) noexcept {
+
+        // The number of outcomes that group_counts divides between the
+        // possible totals, or false if this is too large to count. The
+        // number of rolls for exploding dice isn't fixed, so their
+        // distribution is only ever built in double precision, truncated
+        // at the explosion cap.
+
+        total = 1;
+
+        if (group.explode != 0)
+            return false;
+
+        count_type base = std::uint64_t(group.faces ? group.faces->total : group.one_dice.max() - group.one_dice.min() + 1);
+
+        if (base == 1)
+            return true;
+
+        for (int i = 0; i < group.number; ++i)
+            if (! try_multiply(total, base))
+                return false;
+
+        return true;
+
+    }
+
+    bool Dice::group_moments(const dice_group& group, Rational& mean, Rational& variance) {
+
+        // Exact mean and variance of one group, unscaled. Kept dice need the
+        // exact sums of x and x^2 over every outcome, and custom dice over
+        // every face, relative to the lowest possible result; this fails if
+        // there are too many outcomes to count, or the result can't be
+        // represented.
+
+        int a = group.one_dice.min();
+        int f = group.one_dice.max();
+        int w = f - a + 1;
+
+        if (group.keep != 0 || group.faces) {
+
+            count_type total = 1;
+            count_type sum = 0;
+            count_type sum_squares = 0;
+            int offset = group.low();
+            bool ok = true;
+
+            auto add = [&] (count_type count, std::uint64_t x) {
+                ok = ok && try_multiply(count, x) && try_add(sum, count)
+                    && try_multiply(count, x) && try_add(sum_squares, count);
+            };
+
+            if (group.faces) {
+                auto& faces = *group.faces;
+                total = std::uint64_t(faces.total);
+                offset = faces.values.front();
+                for (size_t i = 0; i < faces.values.size(); ++i)
+                    add(std::uint64_t(faces.weights[i]), std::uint64_t(std::int64_t(faces.values[i]) - offset));
+            } else {
+                if (! group_total(group, total))
+                    return false;
+                auto counts = group_counts(group, total);
+                for (size_t i = 0; i < counts.size(); ++i)
+                    add(counts[i], i);
+            }
+
+            Rational m, v;
+
+            if (! ok || ! exact_fraction(sum, total, m) || ! exact_variance(total, sum, sum_squares, v))
+                return false;
+
+            int copies = group.faces ? group.number : 1;
+            mean = Rational(copies) * (Rational(offset) + m);
+            variance = Rational(copies) * v;
+
+            return true;
+
+        }
+
+        // Exploding dice are taken from the capped distribution, so the
+        // moments agree with the probability table
+
+        if (group.explode != 0)
+            return false;
+
+        mean = Rational(a + f, 2);
+        variance = Rational(w * w - 1, 12);
+        mean *= Rational(group.number);
+        variance *= Rational(group.number);
+
+        return true;
+
+    }
+
+    void Dice::approx_moments(const dice_group& group, double& mean, double& variance) {
+
+        // The same from the double precision distribution. Plain and custom
+        // dice are taken one at a time, since their moments add.
+
+        auto one = group;
+        int copies = 1;
+
+        if (group.keep == 0) {
+            one.number = 1;
+            copies = group.number;
+        }
+
+        auto pdf = group_probabilities(one);
+        double offset = one.faces ? one.faces->values.front() : one.low();
+        mean = variance = 0;
+
+        for (size_t i = 0; i < pdf.size(); ++i)
+            mean += pdf[i] * double(i);
+        for (size_t i = 0; i < pdf.size(); ++i)
+            variance += pdf[i] * (double(i) - mean) * (double(i) - mean);
+
+        mean = copies * (offset + mean);
+        variance *= copies;
+
+    }
+
+    TableDice::TableDice(const Dice& d) {
+
+        auto table = d.check_table();
+
+        if (! table)
+            return;
+
+        values_.clear();
+        table_ = {};
+        table_.total = table->total;
+        auto x = d.min_;
+
+        for (size_t i = 0; i < table->size(); ++i) {
+            if (table->exact() && table->pdf[i] != 0) {
+                values_.push_back(x);
+                table_.pdf.push_back(table->pdf[i]);
+                table_.cdf.push_back(table->cdf[i]);
+            } else if (! table->exact() && table->real_pdf[i] > 0) {
+                values_.push_back(x);
+                table_.real_pdf.push_back(table->real_pdf[i]);
+                table_.real_cdf.push_back(table->real_cdf[i]);
+                table_.real_ccdf.push_back(table->real_ccdf[i]);
+            }
+            x += d.step_;
+        }
+
+        make_aliases();
+
+    }
+
+    Rational TableDice::pdf(const Rational& x) const {
+        auto it = std::lower_bound(values_.begin(), values_.end(), x);
+        if (it == values_.end() || *it != x)
+            return 0;
+        return table_.pdf_at<Rational>(size_t(it - values_.begin()));
+    }
+
+    Rational TableDice::cdf(const Rational& x) const {
+        auto i = size_t(std::upper_bound(values_.begin(), values_.end(), x) - values_.begin());
+        return i == 0 ? Rational(0) : table_.cdf_at<Rational>(i - 1);
+    }
+
+    Rational TableDice::ccdf(const Rational& x) const {
+        auto i = size_t(std::lower_bound(values_.begin(), values_.end(), x) - values_.begin());
+        return i == values_.size() ? Rational(0) : table_.ccdf_at<Rational>(i);
+    }
+
+    void TableDice::make_aliases() {
+
+        // Walker's alias method, using Vose's algorithm to build the table
+
+        int n = int(values_.size());
+        std::vector<double> probs(n);
+        std::vector<int> small, large;
+        aliases_.assign(n, {});
+        index_ = Sci::UniformInteger<int>(0, n - 1);
+
+        for (int i = 0; i < n; ++i) {
+            probs[i] = table_.pdf_at<double>(i) * n;
+            (probs[i] < 1 ? small : large).push_back(i);
+        }
+
+        while (! small.empty() && ! large.empty()) {
+            int i = small.back();
+            int j = large.back();
+            small.pop_back();
+            large.pop_back();
+            aliases_[i] = {probs[i], j};
+            probs[j] -= 1 - probs[i];
+            (probs[j] < 1 ? small : large).push_back(j);
+        }
+
+        // Anything left over is only short of 1 because of rounding error
+
+        for (auto i: small)
+            aliases_[i] = {1, i};
+        for (auto i: large)
+            aliases_[i] = {1, i};
+
+    }
+
+    CompiledDice Dice::compile() const {
+        CompiledDice c;
+        c.sampler_ = sampler_;
+        c.min_ = min_;
+        c.max_ = max_;
+        c.text_ = str();
+        return c;
+    }
+
+    TableDice Dice::max_of(const std::vector<Dice>& list) {
+        return extreme_of(list, false);
+    }
+
+    TableDice Dice::min_of(const std::vector<Dice>& list) {
+        return extreme_of(list, true);
+    }
+
+    TableDice Dice::extreme_of(const std::vector<Dice>& list, bool lowest) {
+
+        // Take the union of the tables' supports, with each table's values
+        // generated by stepping along its own lattice. For the maximum,
+        // Pr(max<=x) is the product of the individual CDFs; for the minimum,
+        // Pr(min>=x) is the product of the individual CCDFs. Each product of
+        // counts is bounded by the product of the totals; if that is too
+        // large, or any table has no counts, double precision probabilities
+        // are used instead.
+
+        static const auto unit = table_data::unit();
+
+        if (list.empty())
+            throw std::invalid_argument("Empty list of dice");
+
+        std::vector<const table_data*> tables;
+        count_type total = 1;
+        bool exact = true;
+
+        for (auto& d: list) {
+            auto table = d.check_table();
+            tables.push_back(table ? table : &unit);
+            exact = exact && tables.back()->exact() && try_multiply(total, tables.back()->total);
+        }
+
+        size_t n = list.size();
+        std::vector<Rational> support;
+
+        for (size_t i = 0; i < n; ++i) {
+            auto x = list[i].min_;
+            for (size_t j = 0; j < tables[i]->size(); ++j) {
+                if (tables[i]->pdf_at<double>(j) > 0)
+                    support.push_back(x);
+                x += list[i].step_;
+            }
+        }
+
+        std::sort(support.begin(), support.end());
+        support.erase(std::unique(support.begin(), support.end()), support.end());
+
+        // below[i] is the number of entries in table i strictly less than
+        // the current value, or no greater than it for the maximum, and
+        // next[i] is the value of the first entry not yet counted. The
+        // cumulative products are Pr(max<=x) or Pr(min>=x).
+
+        std::vector<size_t> below(n, 0);
+        std::vector<Rational> next(n);
+        std::vector<count_type> counts;
+        std::vector<double> probs;
+
+        for (size_t i = 0; i < n; ++i)
+            next[i] = list[i].min_;
+
+        for (size_t k = 0; k < support.size(); ++k) {
+            count_type product = 1;
+            double real_product = 1;
+            for (size_t i = 0; i < n; ++i) {
+                auto& table = *tables[i];
+                while (below[i] < table.size() && (next[i] < support[k] || (! lowest && next[i] == support[k]))) {
+                    ++below[i];
+                    next[i] += list[i].step_;
+                }
+                if (exact) {
+                    auto count = below[i] == 0 ? count_type(0) : table.cdf[below[i] - 1];
+                    product *= lowest ? table.total - count : count;
+                } else if (lowest) {
+                    real_product *= below[i] == table.size() ? 0 : table.ccdf_at<double>(below[i]);
+                } else {
+                    real_product *= below[i] == 0 ? 0 : table.cdf_at<double>(below[i] - 1);
+                }
+            }
+            if (exact)
+                counts.push_back(product);
+            else
+                probs.push_back(real_product);
+        }
+
+        // Differences of the cumulative products give the probability of
+        // each value; values with no chance of being the result are dropped
+
+        TableDice result;
+        result.values_.clear();
+        result.table_ = {};
+        std::vector<double> pdf;
+
+        for (size_t k = 0; k < support.size(); ++k) {
+            size_t adjacent = lowest ? k + 1 : k - 1;
+            bool edge = lowest ? k + 1 == support.size() : k == 0;
+            if (exact) {
+                auto count = counts[k] - (edge ? count_type(0) : counts[adjacent]);
+                if (count != 0) {
+                    result.values_.push_back(support[k]);
+                    result.table_.pdf.push_back(count);
+                }
+            } else {
+                auto p = probs[k] - (edge ? 0 : probs[adjacent]);
+                if (p > 0) {
+                    result.values_.push_back(support[k]);
+                    pdf.push_back(p);
+                }
+            }
+        }
+
+        if (exact) {
+            result.table_.cdf.resize(result.table_.pdf.size());
+            std::partial_sum(result.table_.pdf.begin(), result.table_.pdf.end(), result.table_.cdf.begin());
+            result.table_.total = total;
+        } else {
+            result.table_ = *finish_real_table(std::move(pdf));
+        }
+
+        result.make_aliases();
+
+        return result;
+
+    }
+
+    DicePool::DicePool(std::string_view str) {
+
+        // Same conventions as the Dice parser, with this grammar:
+        //
+        //      ( [+-] )                # sign
+        //      (?:
+        //          (\d*)               # number of dice
+        //          d (\d*)             # number of faces
+        //          >= (\d+)            # success threshold
+        //          (?: f (\d+) ) ?     # botch threshold
+        //      |
+        //          (\d+)               # fixed successes
+        //      )
+        //
+        // Dice groups can't be subtracted.
+
+        dice_scanner scan(str);
+
+        while (scan.peek() != '\0') {
+
+            auto sign = 1;
+            auto c = scan.peek();
+
+            if (c == '+' || c == '-') {
+                sign = c == '-' ? -1 : 1;
+                scan.next();
+            }
+
+            bool has_number = scan.at_digit();
+            int number = scan.parse_integer(1);
+
+            if (scan.peek() == 'd') {
+                scan.next();
+                int faces = scan.parse_integer(6);
+                int botch = 0;
+                if (sign == -1 || scan.peek() != '>')
+                    scan.fail();
+                scan.next();
+                if (scan.peek() != '=')
+                    scan.fail();
+                scan.next();
+                int threshold = scan.parse_required();
+                if (scan.peek() == 'f') {
+                    scan.next();
+                    botch = scan.parse_required();
+                }
+                if (faces == 0 || threshold == 0 || threshold > faces || botch >= threshold)
+                    scan.fail();
+                insert(number, faces, threshold, botch);
+            } else if (has_number) {
+                add_ += sign * number;
+            } else {
+                scan.fail();
+            }
+
+            c = scan.peek();
+
+            if (c != '\0' && c != '+' && c != '-')
+                scan.fail();
+
+        }
+
+        modified();
+
+    }
+
+    DicePool& DicePool::operator+=(const DicePool& b) {
+        for (auto& g: b.groups_)
+            insert(g.number, g.one_dice.max(), g.threshold, g.botch);
+        add_ += b.add_;
+        modified();
+        return *this;
+    }
+
+    Rational DicePool::mean() const {
+        Rational sum = add_;
+        for (auto& g: groups_)
+            sum += Rational(g.number * (g.one_dice.max() - g.threshold + 1 - g.botch), g.one_dice.max());
+        return sum;
+    }
+
+    Rational DicePool::variance() const {
+
+        // Each die scores +1, 0, or -1, so E(x^2) is the chance of either
+        // a success or a botch
+
+        Rational sum;
+
+        for (auto& g: groups_) {
+            int f = g.one_dice.max();
+            int s = f - g.threshold + 1;
+            Rational mean(s - g.botch, f);
+            sum += Rational(g.number) * (Rational(s + g.botch, f) - mean * mean);
+        }
+
+        return sum;
+
+    }
+
+    double DicePool::sd() const {
+        using std::sqrt;
+        return sqrt(double(variance()));
+    }
+
+    Rational DicePool::pdf(int x) const {
+        if (x < min_ || x > max_)
+            return 0;
+        else
+            return table_.pdf_at<Rational>(x - min_);
+    }
+
+    Rational DicePool::cdf(int x) const {
+        if (x < min_)
+            return 0;
+        else if (x >= max_)
+            return 1;
+        else
+            return table_.cdf_at<Rational>(x - min_);
+    }
+
+    Rational DicePool::ccdf(int x) const {
+        if (x <= min_)
+            return 1;
+        else if (x > max_)
+            return 0;
+        else
+            return table_.ccdf_at<Rational>(x - min_);
+    }
+
+    std::string DicePool::str() const {
+
+        std::string text;
+
+        for (auto& g: groups_) {
+            text += '+';
+            if (g.number > 1)
+                text += std::to_string(g.number);
+            text += 'd' + std::to_string(g.one_dice.max()) + ">=" + std::to_string(g.threshold);
+            if (g.botch > 0)
+                text += 'f' + std::to_string(g.botch);
+        }
+
+        if (add_ > 0)
+            text += '+';
+        if (add_ != 0)
+            text += std::to_string(add_);
+
+        if (text[0] == '+')
+            text.erase(0, 1);
+        if (text.empty())
+            text = "0";
+
+        return text;
+
+    }
+
+    void DicePool::insert(int n, int faces, int threshold, int botch) {
+
+        static const auto match_terms = [] (const pool_group& g1, const pool_group& g2) noexcept {
+            return g1.one_dice.max() == g2.one_dice.max() && g1.threshold == g2.threshold && g1.botch == g2.botch;
+        };
+
+        static const auto sort_terms = [] (const pool_group& g1, const pool_group& g2) noexcept {
+            return std::make_tuple(- g1.one_dice.max(), g1.threshold, g1.botch)
+                < std::make_tuple(- g2.one_dice.max(), g2.threshold, g2.botch);
+        };
+
+        if (n < 0 || faces < 0 || (faces > 0 && (threshold < 1 || threshold > faces || botch < 0 || botch >= threshold)))
+            throw std::invalid_argument("Invalid dice");
+
+        if (n == 0 || faces == 0)
+            return;
+
+        pool_group g;
+        g.number = n;
+        g.one_dice = Sci::UniformInteger<int>(1, faces);
+        g.threshold = threshold;
+        g.botch = botch;
+        auto it = std::lower_bound(groups_.begin(), groups_.end(), g, sort_terms);
+
+        if (it != groups_.end() && match_terms(*it, g))
+            it->number += g.number;
+        else
+            groups_.insert(it, g);
+
+    }
+
+    void DicePool::modified() {
+
+        min_ = max_ = add_;
+
+        for (auto& g: groups_) {
+            if (g.botch > 0)
+                min_ -= g.number;
+            max_ += g.number;
+        }
+
+        // Every die is a three way choice between success, botch, or
+        // neither, so the table is a multinomial, built one die at a time.
+        // The face counts for each outcome are divided by their common
+        // factor first, which keeps the total as small as possible. If the
+        // total is still too large, the same recurrence is run on
+        // probabilities.
+
+        Dice::count_type total = 1;
+        bool exact = true;
+
+        for (auto& g: groups_) {
+            int f = g.one_dice.max();
+            int s = f - g.threshold + 1;
+            Dice::count_type w = std::uint64_t(f / std::gcd(std::gcd(s, g.botch), f - s - g.botch));
+            for (int i = 0; i < g.number && exact; ++i)
+                exact = try_multiply(total, w);
+        }
+
+        auto build = [this] (auto zero, auto weights) {
+            std::vector<decltype(zero)> counts = {1};
+            std::vector<decltype(zero)> next;
+            for (auto& g: groups_) {
+                auto [success, botch, neither] = weights(g);
+                size_t shift = g.botch > 0 ? 1 : 0;
+                for (int i = 0; i < g.number; ++i) {
+                    next.assign(counts.size() + shift + 1, zero);
+                    for (size_t j = 0; j < counts.size(); ++j) {
+                        next[j + shift] += counts[j] * neither;
+                        next[j + shift + 1] += counts[j] * success;
+                        if (g.botch > 0)
+                            next[j] += counts[j] * botch;
+                    }
+                    counts.swap(next);
+                }
+            }
+            return counts;
+        };
+
+        if (exact) {
+            table_ = {};
+            table_.pdf = build(Dice::count_type(0), [] (const pool_group& g) {
+                int f = g.one_dice.max();
+                int s = f - g.threshold + 1;
+                int b = g.botch;
+                int common = std::gcd(std::gcd(s, b), f - s - b);
+                return std::array<Dice::count_type, 3>{std::uint64_t(s / common), std::uint64_t(b / common),
+                    std::uint64_t((f - s - b) / common)};
+            });
+            table_.cdf.resize(table_.pdf.size());
+            std::partial_sum(table_.pdf.begin(), table_.pdf.end(), table_.cdf.begin());
+            table_.total = total;
+        } else {
+            table_ = *Dice::finish_real_table(build(0.0, [] (const pool_group& g) {
+                double f = g.one_dice.max();
+                double s = f - g.threshold + 1;
+                return std::array<double, 3>{s / f, g.botch / f, (f - s - g.botch) / f};
+            }));
+        }
+
+    }
+
+    EmpiricalDistribution::EmpiricalDistribution(std::map<Rational, size_t>&& counts):
+    counts_(std::move(counts)) {
+
+        double sum = 0;
+        double sum_squares = 0;
+
+        for (auto& [x, n]: counts_) {
+            trials_ += n;
+            values_.push_back(x);
+            cumulative_.push_back(trials_);
+            double y = double(x);
+            sum += y * double(n);
+            sum_squares += y * y * double(n);
+        }
+
+        if (trials_ != 0) {
+            mean_ = sum / double(trials_);
+            variance_ = std::max(sum_squares / double(trials_) - mean_ * mean_, 0.0);
+        }
+
+    }
+
+    double EmpiricalDistribution::pdf(const Rational& x) const {
+        auto it = counts_.find(x);
+        return it == counts_.end() ? 0.0 : double(it->second) / double(trials_);
+    }
+
+    double EmpiricalDistribution::cdf(const Rational& x) const {
+        auto i = size_t(std::upper_bound(values_.begin(), values_.end(), x) - values_.begin());
+        return i == 0 ? 0.0 : double(cumulative_[i - 1]) / double(trials_);
+    }
+
+    double EmpiricalDistribution::ccdf(const Rational& x) const {
+        auto i = size_t(std::lower_bound(values_.begin(), values_.end(), x) - values_.begin());
+        return i == 0 ? 1.0 : double(trials_ - cumulative_[i - 1]) / double(trials_);
+    }
+
+    double EmpiricalDistribution::distance(const Dice& d) const {
+
+        // Kolmogorov-Smirnov statistic. Between two observed values the
+        // empirical CDF is constant, so the largest difference is at one
+        // of them, or just below the next one.
+
+        double max_diff = 0;
+        double below = 0;
+
+        for (size_t i = 0; i < values_.size(); ++i) {
+            double here = double(cumulative_[i]) / double(trials_);
+            double cdf = d.approx_cdf(values_[i]);
+            max_diff = std::max(max_diff, std::abs(here - cdf));
+            max_diff = std::max(max_diff, std::abs(below - cdf + d.approx_pdf(values_[i])));
+            below = here;
+        }
+
+        return max_diff;
+
+    }
+
+    DiceSimulator::DiceSimulator(size_t threads, std::uint64_t seed):
+    threads_(threads), seed_(seed) {
+        if (threads_ == 0)
+            threads_ = Detail::hardware_threads();
+    }
+
+    EmpiricalDistribution DiceSimulator::operator()(const Dice& d, size_t trials) const {
+
+        // Count the integer lattice offsets directly in an array when the
+        // range is small enough, otherwise fall back on the generic version
+
+        static constexpr size_t histogram_limit = 1 << 20;
+
+        auto size = size_t(((d.max_ - d.min_) / d.step_).num()) + 1;
+
+        if (size > histogram_limit)
+            return (*this)([&d] (StreamRng& rng) { return d(rng); }, trials);
+
+        int offset = ((d.min_ - d.add_) / d.step_).num();
+        using histogram = std::vector<size_t>;
+
+        auto histograms = run<histogram>(trials, [&d,offset,size] (StreamRng& rng, size_t n, histogram& h) {
+            if (h.empty())
+                h.assign(size, 0);
+            d.sampler_->offsets(rng, n, [&h,offset] (const int* sums, size_t /*start*/, size_t count) {
+                for (size_t i = 0; i < count; ++i)
+                    ++h[sums[i] - offset];
+            });
+        });
+
+        std::map<Rational, size_t> merged;
+
+        for (size_t k = 0; k < size; ++k) {
+            size_t n = 0;
+            for (auto& h: histograms)
+                if (! h.empty())
+                    n += h[k];
+            if (n != 0)
+                merged[d.min_ + int(k) * d.step_] = n;
+        }
+
+        return EmpiricalDistribution(std::move(merged));
 
     }
 
@@ -1,28 +1,381 @@
 #pragma once
 
+#include "rs-game/stream-rng.hpp"
 #include "rs-format/string.hpp"
 #include "rs-sci/random.hpp"
 #include "rs-sci/rational.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <numeric>
 #include <ostream>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
 #include <vector>
 
 namespace RS::Game {
 
+    namespace Detail {
+
+        constexpr long long floor_divide(long long x, long long y) noexcept {
+            auto q = x / y;
+            if (q * y != x && (x < 0) != (y < 0))
+                --q;
+            return q;
+        }
+
+        inline size_t hardware_threads() noexcept {
+            return std::max(size_t(std::thread::hardware_concurrency()), size_t(1));
+        }
+
+        // Call f(i,w) for each i in [0,n), on up to the given number of
+        // threads, with w identifying the worker (w<min(threads,n); the
+        // calling thread is worker 0). Work is handed out one index at a
+        // time, so uneven items balance out. If a thread can't be started,
+        // the ones already running do its share. Every thread is joined
+        // before returning, and the first exception thrown by f is rethrown
+        // after that; once one call has thrown, no new items are started.
+
+        template <typename F>
+        void parallel_for(size_t n, size_t threads, F f) {
+
+            size_t workers = std::max(std::min(threads, n), size_t(1));
+            std::vector<std::exception_ptr> errors(workers);
+            std::atomic<size_t> next = 0;
+            std::atomic<bool> failed = false;
+
+            auto work = [&] (size_t w) {
+                try {
+                    for (size_t i = next++; i < n && ! failed; i = next++)
+                        f(i, w);
+                }
+                catch (...) {
+                    errors[w] = std::current_exception();
+                    failed = true;
+                }
+            };
+
+            std::vector<std::thread> pool;
+            pool.reserve(workers - 1);
+
+            for (size_t w = 1; w < workers; ++w) {
+                try {
+                    pool.emplace_back(work, w);
+                }
+                catch (const std::system_error&) {
+                    break;
+                }
+            }
+
+            work(0);
+
+            for (auto& t: pool)
+                t.join();
+
+            for (auto& e: errors)
+                if (e)
+                    std::rethrow_exception(e);
+
+        }
+
+        // Unsigned 128-bit integer, with only the operations the probability
+        // tables need. Arithmetic wraps modulo 2^128, like the built in
+        // unsigned types.
+
+        class uint128 {
+
+        public:
+
+            constexpr uint128() noexcept = default;
+            constexpr uint128(std::uint64_t x) noexcept: lo_(x) {}
+            constexpr uint128(std::uint64_t hi, std::uint64_t lo) noexcept: hi_(hi), lo_(lo) {}
+
+            explicit operator double() const noexcept { return std::ldexp(double(hi_), 64) + double(lo_); }
+
+            constexpr std::uint64_t high() const noexcept { return hi_; }
+            constexpr std::uint64_t low() const noexcept { return lo_; }
+
+            constexpr uint128& operator+=(uint128 y) noexcept;
+            constexpr uint128& operator-=(uint128 y) noexcept;
+            constexpr uint128& operator*=(uint128 y) noexcept;
+            uint128& operator/=(uint128 y) noexcept { uint128 r; divide(*this, y, *this, r); return *this; }
+            uint128& operator%=(uint128 y) noexcept { uint128 q; divide(*this, y, q, *this); return *this; }
+
+            static constexpr uint128 max() noexcept { return {~ std::uint64_t(0), ~ std::uint64_t(0)}; }
+            static constexpr uint128 wide_multiply(std::uint64_t x, std::uint64_t y) noexcept;
+            static void divide(uint128 x, uint128 y, uint128& q, uint128& r) noexcept;
+
+            friend constexpr uint128 operator+(uint128 x, uint128 y) noexcept { return x += y; }
+            friend constexpr uint128 operator-(uint128 x, uint128 y) noexcept { return x -= y; }
+            friend constexpr uint128 operator*(uint128 x, uint128 y) noexcept { return x *= y; }
+            friend uint128 operator/(uint128 x, uint128 y) noexcept { return x /= y; }
+            friend uint128 operator%(uint128 x, uint128 y) noexcept { return x %= y; }
+            friend constexpr bool operator==(uint128 x, uint128 y) noexcept { return x.hi_ == y.hi_ && x.lo_ == y.lo_; }
+            friend constexpr bool operator!=(uint128 x, uint128 y) noexcept { return ! (x == y); }
+            friend constexpr bool operator<(uint128 x, uint128 y) noexcept { return x.hi_ == y.hi_ ? x.lo_ < y.lo_ : x.hi_ < y.hi_; }
+            friend constexpr bool operator>(uint128 x, uint128 y) noexcept { return y < x; }
+            friend constexpr bool operator<=(uint128 x, uint128 y) noexcept { return ! (y < x); }
+            friend constexpr bool operator>=(uint128 x, uint128 y) noexcept { return ! (x < y); }
+
+        private:
+
+            std::uint64_t hi_ = 0;
+            std::uint64_t lo_ = 0;
+
+        };
+
+        constexpr uint128& uint128::operator+=(uint128 y) noexcept {
+            lo_ += y.lo_;
+            hi_ += y.hi_ + std::uint64_t(lo_ < y.lo_);
+            return *this;
+        }
+
+        constexpr uint128& uint128::operator-=(uint128 y) noexcept {
+            hi_ -= y.hi_ + std::uint64_t(lo_ < y.lo_);
+            lo_ -= y.lo_;
+            return *this;
+        }
+
+        constexpr uint128& uint128::operator*=(uint128 y) noexcept {
+            auto product = wide_multiply(lo_, y.lo_);
+            product.hi_ += hi_ * y.lo_ + lo_ * y.hi_;
+            return *this = product;
+        }
+
+        constexpr uint128 uint128::wide_multiply(std::uint64_t x, std::uint64_t y) noexcept {
+
+            // Schoolbook multiplication on 32-bit halves
+
+            constexpr std::uint64_t mask = 0xffff'ffff;
+
+            auto p00 = (x & mask) * (y & mask);
+            auto p01 = (x & mask) * (y >> 32);
+            auto p10 = (x >> 32) * (y & mask);
+            auto p11 = (x >> 32) * (y >> 32);
+            auto middle = (p00 >> 32) + (p01 & mask) + (p10 & mask);
+
+            return {p11 + (p01 >> 32) + (p10 >> 32) + (middle >> 32), (middle << 32) | (p00 & mask)};
+
+        }
+
+        inline void uint128::divide(uint128 x, uint128 y, uint128& q, uint128& r) noexcept {
+
+            // Shift and subtract, one bit at a time, unless both fit in
+            // 64 bits. The remainder is always less than y, so if
+            // shifting it carries out of the top bit, it must be bigger
+            // than y.
+
+            if (x.hi_ == 0 && y.hi_ == 0) {
+                q = x.lo_ / y.lo_;
+                r = x.lo_ % y.lo_;
+                return;
+            }
+
+            uint128 quotient;
+            uint128 remainder;
+
+            for (int i = 127; i >= 0; --i) {
+                auto bit = (i >= 64 ? x.hi_ >> (i - 64) : x.lo_ >> i) & 1;
+                bool carry = (remainder.hi_ >> 63) != 0;
+                remainder = {(remainder.hi_ << 1) | (remainder.lo_ >> 63), (remainder.lo_ << 1) | bit};
+                quotient = {(quotient.hi_ << 1) | (quotient.lo_ >> 63), quotient.lo_ << 1};
+                if (carry || remainder >= y) {
+                    remainder -= y;
+                    quotient.lo_ |= 1;
+                }
+            }
+
+            q = quotient;
+            r = remainder;
+
+        }
+
+        // Fast path for summing many dice, used when the RNG generates full
+        // 32 or 64 bit words. Each die is generated from a 32-bit word using
+        // Lemire's multiply-shift method, which is exactly uniform after
+        // rejecting the rare words whose low product bits fall below a
+        // threshold. The words are drawn into a block first, so the
+        // multiply-shift-add loop has no dependency on the RNG and can be
+        // vectorized by the compiler; a block containing a rejected word is
+        // reprocessed one die at a time.
+
+        template <typename RNG> constexpr bool is_word_rng =
+            RNG::min() == 0 && (std::uint64_t(RNG::max()) == 0xffff'ffffull || std::uint64_t(RNG::max()) == ~ 0ull);
+
+        constexpr int simd_dice_threshold = 8;
+
+        template <typename RNG>
+        std::uint32_t next_word(RNG& rng) {
+            return std::uint32_t(rng());
+        }
+
+        template <typename RNG>
+        void fill_words(RNG& rng, std::uint32_t* words, int n) {
+            if constexpr (std::uint64_t(RNG::max()) == 0xffff'ffffull) {
+                for (int i = 0; i < n; ++i)
+                    words[i] = std::uint32_t(rng());
+            } else {
+                for (int i = 0; i < n; i += 2) {
+                    std::uint64_t x = rng();
+                    words[i] = std::uint32_t(x);
+                    if (i + 1 < n)
+                        words[i + 1] = std::uint32_t(x >> 32);
+                }
+            }
+        }
+
+        template <typename RNG, typename F>
+        int sum_uniform(RNG& rng, int n, int faces, F value) {
+
+            // Sums value(k) over n dice, where k is the zero-based face
+
+            static constexpr int block_size = 64;
+
+            std::uint32_t words[block_size];
+            auto f = std::uint32_t(faces);
+            auto threshold = std::uint32_t(- f) % f;
+            int sum = 0;
+
+            auto one_die = [&] (std::uint32_t word) {
+                auto x = std::uint64_t(word) * f;
+                while (std::uint32_t(x) < threshold)
+                    x = std::uint64_t(next_word(rng)) * f;
+                return value(std::uint32_t(x >> 32));
+            };
+
+            // The fixed trip count lets the compiler vectorize this loop
+            // even at -O2
+
+            for (; n >= block_size; n -= block_size) {
+
+                long long block_sum = 0;
+                std::uint32_t rejected = 0;
+                fill_words(rng, words, block_size);
+
+                for (int i = 0; i < block_size; ++i) {
+                    auto x = std::uint64_t(words[i]) * f;
+                    block_sum += value(std::uint32_t(x >> 32));
+                    rejected |= std::uint32_t(std::uint32_t(x) < threshold);
+                }
+
+                if (rejected) {
+                    block_sum = 0;
+                    for (int i = 0; i < block_size; ++i)
+                        block_sum += one_die(words[i]);
+                }
+
+                sum += int(block_sum);
+
+            }
+
+            fill_words(rng, words, n);
+
+            for (int i = 0; i < n; ++i)
+                sum += one_die(words[i]);
+
+            return sum;
+
+        }
+
+        template <typename RNG>
+        int sum_uniform(RNG& rng, int n, int faces) {
+            return sum_uniform(rng, n, faces, [] (std::uint32_t k) { return int(k) + 1; });
+        }
+
+        // Distribution of NdF for StaticDice, built at compile time
+
+        template <int N, int F>
+        constexpr std::array<std::uint64_t, size_t(N) * (F - 1) + 2> static_dice_table(bool cumulative) {
+
+            // Add one die at a time, updating the counts in place from the
+            // top down so each sum only reads counts not yet updated. The
+            // last element is the total. Throwing on overflow makes it a
+            // compile time error.
+
+            constexpr size_t size = size_t(N) * (F - 1) + 1;
+            std::array<std::uint64_t, size + 1> table {};
+            std::uint64_t total = 1;
+            table[0] = 1;
+
+            for (int i = 1; i <= N; ++i) {
+                if (total > ~ std::uint64_t(0) / F)
+                    throw std::overflow_error("Dice probability table is too large");
+                total *= F;
+                for (size_t j = size_t(i) * (F - 1) + 1; j-- > 0;) {
+                    std::uint64_t sum = 0;
+                    for (size_t v = 0; v < size_t(F) && v <= j; ++v)
+                        sum += table[j - v];
+                    table[j] = sum;
+                }
+            }
+
+            if (cumulative) {
+                std::uint64_t sum = 0;
+                for (size_t j = 0; j < size; ++j) {
+                    auto count = table[j];
+                    table[j] = sum;
+                    sum += count;
+                }
+            }
+
+            table[size] = total;
+
+            return table;
+
+        }
+
+        template <typename RNG>
+        int count_uniform(RNG& rng, int n, int faces, int threshold, int botch) {
+            auto hit = std::uint32_t(threshold - 1);
+            auto miss = std::uint32_t(botch);
+            return sum_uniform(rng, n, faces, [hit,miss] (std::uint32_t k) { return int(k >= hit) - int(k < miss); });
+        }
+
+    }
+
+    class CompiledDice;
+    class DicePool;
+    class TableDice;
+
     class Dice {
 
     public:
 
         using result_type = Sci::Rational;
 
+        struct comparison {
+            Sci::Rational win; // Pr(a>b)
+            Sci::Rational tie; // Pr(a=b)
+            Sci::Rational loss; // Pr(a<b)
+        };
+
+        template <typename T>
+        struct distribution_arrays {
+            std::vector<T> values;
+            std::vector<T> pdf;
+            std::vector<T> cdf;
+            std::vector<T> ccdf;
+        };
+
         Dice() = default;
         explicit Dice(int n, int faces = 6, const Sci::Rational& factor = 1) { insert(n, faces, factor); modified(); }
-        explicit Dice(const std::string& str);
+        explicit Dice(int n, const std::vector<int>& faces, const Sci::Rational& factor = 1);
+        explicit Dice(std::string_view str);
 
         template <typename RNG> Sci::Rational operator()(RNG& rng) const;
+        template <typename RNG> void roll_n(RNG& rng, Sci::Rational* out, size_t n) const;
 
         Dice operator+() const { return *this; }
         Dice operator-() const;
@@ -37,65 +390,356 @@ namespace RS::Game {
         Dice& operator/=(const Sci::Rational& b) { return *this *= b.reciprocal(); }
         Dice& operator/=(int b) { return *this *= Sci::Rational(int(1), b); }
 
-        Sci::Rational mean() const noexcept;
-        Sci::Rational variance() const noexcept;
-        double sd() const noexcept;
+        Sci::Rational mean() const;
+        Sci::Rational variance() const;
+        double sd() const;
         Sci::Rational min() const noexcept { return min_; }
         Sci::Rational max() const noexcept { return max_; }
         Sci::Rational pdf(const Sci::Rational& x) const;
         Sci::Rational cdf(const Sci::Rational& x) const;
         Sci::Rational ccdf(const Sci::Rational& x) const;
         Sci::Rational interval(const Sci::Rational& x, const Sci::Rational& y) const;
+        Sci::Rational quantile(const Sci::Rational& p) const;
+        void quantiles(const Sci::Rational* p, Sci::Rational* out, size_t n) const;
+        std::map<Sci::Rational, Sci::Rational> table() const;
+        template <typename T> distribution_arrays<T> arrays() const;
+        double approx_pdf(const Sci::Rational& x) const;
+        double approx_cdf(const Sci::Rational& x) const;
+        double approx_ccdf(const Sci::Rational& x) const;
+        size_t normal_limit() const noexcept { return normal_limit_; }
+        void set_normal_limit(size_t n);
         std::string str() const;
 
+        static comparison compare(const Dice& a, const Dice& b);
+        static std::vector<comparison> compare(const Dice& a, const std::vector<Dice>& b);
+        static TableDice max_of(const std::vector<Dice>& list);
+        static TableDice min_of(const std::vector<Dice>& list);
+        CompiledDice compile() const;
+
+        static size_t cache_hits() noexcept;
+        static size_t cache_misses() noexcept;
+        static size_t cache_size() noexcept;
+        static void clear_cache() noexcept;
+        static void set_cache_limit(size_t n) noexcept;
+        static size_t parallel_threshold() noexcept;
+        static void set_parallel_threshold(size_t n) noexcept;
+
     private:
 
+        friend class CompiledDice;
+        friend class DicePool;
+        friend class DiceSimulator;
+        friend class IntDice;
+        friend class TableDice;
+
+        using count_type = Detail::uint128;
         using distribution_type = Sci::UniformInteger<int>;
-        using pdf_table = std::map<Sci::Rational, Sci::Rational>;
+
+        struct face_set {
+            std::vector<int> values; // ascending
+            std::vector<int> weights; // reduced by their gcd
+            int total = 0; // sum of weights
+            std::vector<int> threshold; // keep the chosen face if a draw in [0,total) is below this
+            std::vector<int> alias;
+            distribution_type index {0, 0};
+            distribution_type draw {0, 0};
+            template <typename RNG> int operator()(RNG& rng) const;
+        };
 
         struct dice_group {
             int number;
-            distribution_type one_dice;
+            distribution_type one_dice; // min>1 if low rolls are rerolled; face range if custom
+            std::shared_ptr<const face_set> faces; // custom faces, null for consecutive integers
             Sci::Rational factor;
+            int multiple = 1; // factor / step
+            int keep = 0; // number of dice kept, 0 for all
+            bool lowest = false; // keep lowest instead of highest
+            int explode = 0; // explode on this or higher, 0 for none
+            int depth = 0; // maximum explosions per die
+            int kept() const noexcept { return keep == 0 ? number : keep; }
+            int low() const noexcept { return kept() * one_dice.min(); }
+            int high() const noexcept { return kept() * one_dice.max() * (depth + 1); }
         };
 
-        struct probabilites {
-            Sci::Rational pdf;
-            Sci::Rational cdf;
-            Sci::Rational ccdf;
+        struct count_table {
+            std::vector<count_type> counts = {1};
+            count_type total = 1;
         };
 
-        using probability_table = std::map<Sci::Rational, probabilites>;
+        struct table_data {
+            std::vector<count_type> pdf; // empty if too large to count
+            std::vector<count_type> cdf;
+            count_type total = 0;
+            std::vector<double> real_pdf; // normalized, used only if the counts are empty
+            std::vector<double> real_cdf;
+            std::vector<double> real_ccdf;
+            bool exact() const noexcept { return ! pdf.empty(); }
+            size_t size() const noexcept { return exact() ? pdf.size() : real_pdf.size(); }
+            template <typename T> T pdf_at(size_t i) const;
+            template <typename T> T cdf_at(size_t i) const; // Pr(k<=i)
+            template <typename T> T ccdf_at(size_t i) const; // Pr(k>=i)
+            static table_data unit() { table_data t; t.pdf = t.cdf = {1}; t.total = 1; return t; }
+        };
 
         struct table_info {
-            probability_table table;
-            std::mutex mutex;
+            std::shared_ptr<const table_data> data;
+            std::atomic<bool> ready = false;
+            std::once_flag once;
+        };
+
+        struct approx_data {
+            std::vector<double> pdf; // empty for normal approximation
+            std::vector<double> cdf;
+            std::vector<double> ccdf;
+            double mean = 0;
+            double sd = 0;
+        };
+
+        struct approx_info {
+            std::shared_ptr<const approx_data> data;
+            std::once_flag once;
+        };
+
+        struct moments_info {
+            Sci::Rational mean;
+            Sci::Rational variance;
+            std::once_flag once;
+        };
+
+        // Every way of rolling the dice goes through the sampler, a lowered
+        // form of the groups built once per expression. The groups are
+        // sorted into one list per kind, so the rolling loops never branch
+        // on the kind of group. The result is add+sum*step, where sum is the
+        // integer lattice offset, using integer arithmetic when add and
+        // step are integers.
+
+        struct sampler {
+            std::vector<dice_group> uniform;
+            std::vector<dice_group> explode;
+            std::vector<dice_group> keep;
+            std::vector<dice_group> custom;
+            Sci::Rational add;
+            Sci::Rational step = 1;
+            bool integral = true; // add and step are integers
+            template <typename RNG> int offset(RNG& rng) const;
+            template <typename RNG, typename F> void offsets(RNG& rng, size_t n, F f) const;
+            template <typename RNG> Sci::Rational roll(RNG& rng) const;
+            template <typename RNG> void roll_n(RNG& rng, Sci::Rational* out, size_t n) const;
         };
 
+        class table_cache;
+
+        static constexpr size_t default_normal_limit = 1 << 20;
+        static constexpr int histogram_limit = 256; // keep dice by histogram up to this many faces
+
         std::vector<dice_group> groups_;
         Sci::Rational add_;
         Sci::Rational min_;
         Sci::Rational max_;
+        Sci::Rational step_ = 1;
         std::shared_ptr<table_info> info_;
+        std::shared_ptr<approx_info> approx_;
+        std::shared_ptr<moments_info> moments_;
+        std::shared_ptr<const sampler> sampler_ = null_sampler();
+        size_t normal_limit_ = default_normal_limit;
 
-        bool check_table() const;
-        void insert(int n, int faces, const Sci::Rational& factor);
+        template <typename RNG> static int roll_uniform(RNG& rng, const dice_group& g);
+        template <typename RNG> static int roll_explode(RNG& rng, const dice_group& g);
+        template <typename RNG> static int roll_keep(RNG& rng, const dice_group& g);
+        template <typename RNG> static int roll_custom(RNG& rng, const dice_group& g);
+        static std::shared_ptr<const sampler> null_sampler();
+        std::shared_ptr<const table_data> built_table() const noexcept;
+        const approx_data* check_approx() const;
+        std::shared_ptr<const approx_data> make_approx() const;
+        const table_data* check_table() const;
+        void insert(int n, int faces, const Sci::Rational& factor, int keep = 0, bool lowest = false, int reroll = 0, int explode = 0);
+        void insert(int n, std::vector<std::pair<int, int>> faces, const Sci::Rational& factor);
+        void insert(const dice_group& g);
+        std::shared_ptr<const table_data> make_data() const;
         void modified();
+        const moments_info* check_moments() const;
+        void make_moments(Sci::Rational& mean, Sci::Rational& variance) const;
+        void set_table(std::shared_ptr<const table_data> data);
 
-        static pdf_table make_table(const dice_group& group);
+        static std::shared_ptr<const table_data> combine_tables(const Dice& lhs, const Dice& rhs, bool negate,
+            const Sci::Rational& step);
+        static count_table expand_table(const table_data& data, size_t stride, bool reverse);
+        static std::shared_ptr<const table_data> finish_table(count_table&& sums);
+        static std::shared_ptr<const table_data> finish_real_table(std::vector<double>&& pdf);
+        static count_table convolve(const count_table& t1, const count_table& t2);
+        static count_table convolve_parallel(const count_table& t1, const count_table& t2);
+        static TableDice extreme_of(const std::vector<Dice>& list, bool lowest);
+        static count_table make_table(const dice_group& group);
+        static std::vector<double> approx_group(const dice_group& group);
+        static std::vector<count_type> group_counts(const dice_group& group, count_type& total);
+        static std::vector<double> group_probabilities(const dice_group& group);
+        static bool group_total(const dice_group& group, count_type& total) noexcept;
+        static bool group_moments(const dice_group& group, Sci::Rational& mean, Sci::Rational& variance);
+        static void approx_moments(const dice_group& group, double& mean, double& variance);
 
     };
 
         template <typename RNG>
         Sci::Rational Dice::operator()(RNG& rng) const {
-            Sci::Rational sum = add_;
-            for (auto& g: groups_) {
-                int roll = 0;
+            return sampler_->roll(rng);
+        }
+
+        template <typename RNG>
+        void Dice::roll_n(RNG& rng, Sci::Rational* out, size_t n) const {
+            sampler_->roll_n(rng, out, n);
+        }
+
+        template <typename RNG>
+        int Dice::face_set::operator()(RNG& rng) const {
+            int i = index(rng);
+            if (threshold[i] < total && draw(rng) >= threshold[i])
+                i = alias[i];
+            return values[i];
+        }
+
+        template <typename RNG>
+        int Dice::sampler::offset(RNG& rng) const {
+            int sum = 0;
+            for (auto& g: uniform)
+                sum += g.multiple * roll_uniform(rng, g);
+            for (auto& g: explode)
+                sum += g.multiple * roll_explode(rng, g);
+            for (auto& g: keep)
+                sum += g.multiple * roll_keep(rng, g);
+            for (auto& g: custom)
+                sum += g.multiple * roll_custom(rng, g);
+            return sum;
+        }
+
+        template <typename RNG, typename F>
+        void Dice::sampler::offsets(RNG& rng, size_t n, F f) const {
+
+            // Generate the lattice offsets in blocks, looping over the dice
+            // groups once per block instead of once per roll
+
+            static constexpr size_t block_size = 256;
+
+            int sums[block_size];
+
+            for (size_t start = 0; start < n; start += block_size) {
+                size_t count = std::min(block_size, n - start);
+                std::fill_n(sums, count, 0);
+                for (auto& g: uniform)
+                    for (size_t i = 0; i < count; ++i)
+                        sums[i] += g.multiple * roll_uniform(rng, g);
+                for (auto& g: explode)
+                    for (size_t i = 0; i < count; ++i)
+                        sums[i] += g.multiple * roll_explode(rng, g);
+                for (auto& g: keep)
+                    for (size_t i = 0; i < count; ++i)
+                        sums[i] += g.multiple * roll_keep(rng, g);
+                for (auto& g: custom)
+                    for (size_t i = 0; i < count; ++i)
+                        sums[i] += g.multiple * roll_custom(rng, g);
+                f(sums, start, count);
+            }
+
+        }
+
+        template <typename RNG>
+        Sci::Rational Dice::sampler::roll(RNG& rng) const {
+            int sum = offset(rng);
+            if (integral)
+                return add.num() + sum * step.num();
+            else
+                return add + sum * step;
+        }
+
+        template <typename RNG>
+        void Dice::sampler::roll_n(RNG& rng, Sci::Rational* out, size_t n) const {
+            offsets(rng, n, [this,out] (const int* sums, size_t start, size_t count) {
+                if (integral) {
+                    int a = add.num();
+                    int s = step.num();
+                    for (size_t i = 0; i < count; ++i)
+                        out[start + i] = a + sums[i] * s;
+                } else {
+                    for (size_t i = 0; i < count; ++i)
+                        out[start + i] = add + sums[i] * step;
+                }
+            });
+        }
+
+        template <typename RNG>
+        int Dice::roll_uniform(RNG& rng, const dice_group& g) {
+            if constexpr (Detail::is_word_rng<RNG>) {
+                if (g.number >= Detail::simd_dice_threshold)
+                    return Detail::sum_uniform(rng, g.number, g.one_dice.max() - g.one_dice.min() + 1)
+                        + g.number * (g.one_dice.min() - 1);
+            }
+            int roll = 0;
+            for (int i = 0; i < g.number; ++i)
+                roll += g.one_dice(rng);
+            return roll;
+        }
+
+        template <typename RNG>
+        int Dice::roll_explode(RNG& rng, const dice_group& g) {
+            int roll = 0;
+            for (int i = 0; i < g.number; ++i) {
+                for (int j = 0; j <= g.depth; ++j) {
+                    int x = g.one_dice(rng);
+                    roll += x;
+                    if (x < g.explode)
+                        break;
+                }
+            }
+            return roll;
+        }
+
+        template <typename RNG>
+        int Dice::roll_keep(RNG& rng, const dice_group& g) {
+
+            // Count the rolls in a histogram when there are few enough
+            // faces, otherwise partially sort them
+
+            int low = g.one_dice.min();
+            int width = g.one_dice.max() - low + 1;
+
+            if (width <= histogram_limit) {
+                int histogram[histogram_limit];
+                std::fill_n(histogram, width, 0);
                 for (int i = 0; i < g.number; ++i)
-                    roll += g.one_dice(rng);
-                sum += roll * g.factor;
+                    ++histogram[g.one_dice(rng) - low];
+                int remaining = g.keep;
+                int roll = 0;
+                for (int i = 0; remaining > 0; ++i) {
+                    int face = g.lowest ? i : width - 1 - i;
+                    int n = std::min(histogram[face], remaining);
+                    roll += n * (low + face);
+                    remaining -= n;
+                }
+                return roll;
             }
-            return sum;
+
+            int buffer[64];
+            std::vector<int> heap;
+            int* rolls = buffer;
+            if (g.number > 64) {
+                heap.resize(g.number);
+                rolls = heap.data();
+            }
+            for (int i = 0; i < g.number; ++i)
+                rolls[i] = g.one_dice(rng);
+            if (g.lowest)
+                std::nth_element(rolls, rolls + g.keep, rolls + g.number);
+            else
+                std::nth_element(rolls, rolls + g.keep, rolls + g.number, std::greater<>());
+            return std::accumulate(rolls, rolls + g.keep, 0);
+
+        }
+
+        template <typename RNG>
+        int Dice::roll_custom(RNG& rng, const dice_group& g) {
+            int roll = 0;
+            for (int i = 0; i < g.number; ++i)
+                roll += (*g.faces)(rng);
+            return roll;
         }
 
     class IntDice {
@@ -105,19 +749,20 @@ namespace RS::Game {
         using result_type = int;
 
         IntDice() = default;
-        explicit IntDice(int n, int faces = 6, int factor = 1): rdice_(n, faces, factor) {}
-        explicit IntDice(const std::string& str): rdice_(str) {}
+        explicit IntDice(int n, int faces = 6, int factor = 1): rdice_(n, faces, factor) { update(); }
+        explicit IntDice(std::string_view str): rdice_(str) { update(); }
 
-        template <typename RNG> int operator()(RNG& rng) const { return rdice_(rng).floor(); }
+        template <typename RNG> int operator()(RNG& rng) const;
+        template <typename RNG> void roll_n(RNG& rng, int* out, size_t n) const;
 
         IntDice operator+() const { return *this; }
-        IntDice operator-() const { IntDice d; d.rdice_ = - rdice_; return d; }
-        IntDice& operator+=(const IntDice& b) { rdice_ += b.rdice_; return *this; }
-        IntDice& operator+=(int b) { rdice_ += b; return *this; }
-        IntDice& operator-=(const IntDice& b) { rdice_ -= b.rdice_; return *this; }
-        IntDice& operator-=(int b) { rdice_ -= b; return *this; }
-        IntDice& operator*=(int b) { rdice_ *= b; return *this; }
-        IntDice& operator/=(int b) { rdice_ /= b; return *this; }
+        IntDice operator-() const { IntDice d; d.rdice_ = - rdice_; d.update(); return d; }
+        IntDice& operator+=(const IntDice& b) { rdice_ += b.rdice_; update(); return *this; }
+        IntDice& operator+=(int b) { rdice_ += b; update(); return *this; }
+        IntDice& operator-=(const IntDice& b) { rdice_ -= b.rdice_; update(); return *this; }
+        IntDice& operator-=(int b) { rdice_ -= b; update(); return *this; }
+        IntDice& operator*=(int b) { rdice_ *= b; update(); return *this; }
+        IntDice& operator/=(int b) { rdice_ /= b; update(); return *this; }
 
         int min() const noexcept { return rdice_.min().floor(); }
         int max() const noexcept { return rdice_.max().floor(); }
@@ -125,10 +770,368 @@ namespace RS::Game {
 
     private:
 
+        // The result is floor((add+step*sum)/den), where sum is the integer
+        // lattice offset generated by the dice groups, so rolling needs only
+        // integer arithmetic, with no division at all when den=1
+
         Dice rdice_;
+        long long add_ = 0;
+        long long step_ = 1;
+        long long den_ = 1;
+
+        int scale(long long sum) const noexcept;
+        void update();
+
+    };
+
+        template <typename RNG>
+        int IntDice::operator()(RNG& rng) const {
+            return scale(rdice_.sampler_->offset(rng));
+        }
+
+        template <typename RNG>
+        void IntDice::roll_n(RNG& rng, int* out, size_t n) const {
+            rdice_.sampler_->offsets(rng, n, [this,out] (const int* sums, size_t offset, size_t count) {
+                for (size_t i = 0; i < count; ++i)
+                    out[offset + i] = scale(sums[i]);
+            });
+        }
+
+        inline int IntDice::scale(long long sum) const noexcept {
+            auto x = add_ + step_ * sum;
+            return int(den_ == 1 ? x : Detail::floor_divide(x, den_));
+        }
+
+        inline void IntDice::update() {
+            den_ = std::lcm(rdice_.add_.den(), rdice_.step_.den());
+            add_ = (rdice_.add_ * int(den_)).num();
+            step_ = (rdice_.step_ * int(den_)).num();
+        }
+
+    class CompiledDice {
+
+    public:
+
+        using result_type = Sci::Rational;
+
+        CompiledDice() = default;
+
+        template <typename RNG> Sci::Rational operator()(RNG& rng) const;
+        template <typename RNG> void roll_n(RNG& rng, Sci::Rational* out, size_t n) const;
+
+        Sci::Rational min() const noexcept { return min_; }
+        Sci::Rational max() const noexcept { return max_; }
+        std::string str() const { return text_; }
+
+    private:
+
+        friend class Dice;
+
+        // Only a shared handle to the lowered sampler that the Dice object
+        // itself rolls through, without the tables and caches
+
+        std::shared_ptr<const Dice::sampler> sampler_ = Dice::null_sampler();
+        Sci::Rational min_;
+        Sci::Rational max_;
+        std::string text_ = "0";
+
+    };
+
+        template <typename RNG>
+        Sci::Rational CompiledDice::operator()(RNG& rng) const {
+            return sampler_->roll(rng);
+        }
+
+        template <typename RNG>
+        void CompiledDice::roll_n(RNG& rng, Sci::Rational* out, size_t n) const {
+            sampler_->roll_n(rng, out, n);
+        }
+
+    class TableDice {
+
+    public:
+
+        using result_type = Sci::Rational;
+
+        TableDice() = default;
+        explicit TableDice(const Dice& d);
+
+        template <typename RNG> Sci::Rational operator()(RNG& rng) const;
+
+        Sci::Rational min() const noexcept { return values_.front(); }
+        Sci::Rational max() const noexcept { return values_.back(); }
+        Sci::Rational pdf(const Sci::Rational& x) const;
+        Sci::Rational cdf(const Sci::Rational& x) const;
+        Sci::Rational ccdf(const Sci::Rational& x) const;
+
+    private:
+
+        friend class Dice;
+
+        struct alias_entry {
+            double prob = 1;
+            int alias = 0;
+        };
+
+        std::vector<alias_entry> aliases_ = {{}};
+        std::vector<Sci::Rational> values_ = {0};
+        Dice::table_data table_ = Dice::table_data::unit(); // indexed by position in values
+        Sci::UniformInteger<int> index_ {0, 0};
+
+        void make_aliases();
+
+    };
+
+        template <typename RNG>
+        Sci::Rational TableDice::operator()(RNG& rng) const {
+            int i = index_(rng);
+            auto& entry = aliases_[i];
+            if (entry.prob < 1 && std::uniform_real_distribution<double>()(rng) >= entry.prob)
+                i = entry.alias;
+            return values_[i];
+        }
+
+    class DicePool {
+
+    public:
+
+        using result_type = int;
+
+        DicePool() = default;
+        explicit DicePool(int n, int faces, int threshold, int botch = 0) { insert(n, faces, threshold, botch); modified(); }
+        explicit DicePool(std::string_view str);
+
+        template <typename RNG> int operator()(RNG& rng) const;
+        template <typename RNG> void roll_n(RNG& rng, int* out, size_t n) const;
+
+        DicePool& operator+=(const DicePool& b);
+        DicePool& operator+=(int b) { add_ += b; modified(); return *this; }
+        DicePool& operator-=(int b) { add_ -= b; modified(); return *this; }
+
+        Sci::Rational mean() const;
+        Sci::Rational variance() const;
+        double sd() const;
+        int min() const noexcept { return min_; }
+        int max() const noexcept { return max_; }
+        Sci::Rational pdf(int x) const;
+        Sci::Rational cdf(int x) const;
+        Sci::Rational ccdf(int x) const;
+        std::string str() const;
+
+    private:
+
+        struct pool_group {
+            int number;
+            Sci::UniformInteger<int> one_dice;
+            int threshold; // success on this or higher
+            int botch = 0; // lose a success on this or lower
+        };
+
+        std::vector<pool_group> groups_;
+        int add_ = 0;
+        int min_ = 0;
+        int max_ = 0;
+        Dice::table_data table_ = Dice::table_data::unit();
+
+        void insert(int n, int faces, int threshold, int botch);
+        void modified();
+
+    };
+
+        template <typename RNG>
+        int DicePool::operator()(RNG& rng) const {
+            int count = add_;
+            for (auto& g: groups_) {
+                if constexpr (Detail::is_word_rng<RNG>) {
+                    if (g.number >= Detail::simd_dice_threshold) {
+                        count += Detail::count_uniform(rng, g.number, g.one_dice.max(), g.threshold, g.botch);
+                        continue;
+                    }
+                }
+                for (int i = 0; i < g.number; ++i) {
+                    int x = g.one_dice(rng);
+                    count += int(x >= g.threshold) - int(x <= g.botch);
+                }
+            }
+            return count;
+        }
+
+        template <typename RNG>
+        void DicePool::roll_n(RNG& rng, int* out, size_t n) const {
+            for (size_t i = 0; i < n; ++i)
+                out[i] = (*this)(rng);
+        }
+
+    template <int N, int F, int Add = 0>
+    class StaticDice {
+
+    public:
+
+        static_assert(N >= 0 && F >= 1, "Invalid dice");
+
+        using count_type = std::uint64_t;
+        using result_type = int;
+
+        static constexpr int number = N;
+        static constexpr int faces = F;
+        static constexpr int add = Add;
+        static constexpr size_t table_size = size_t(N) * (F - 1) + 1;
+
+        template <typename RNG> int operator()(RNG& rng) const;
+
+        static constexpr int min() noexcept { return N + Add; }
+        static constexpr int max() noexcept { return N * F + Add; }
+        static constexpr double mean() noexcept { return N * (F + 1) / 2.0 + Add; }
+        static constexpr double variance() noexcept { return N * (double(F) * F - 1) / 12; }
+        static double sd() noexcept { using std::sqrt; return sqrt(variance()); }
+        static constexpr double pdf(int x) noexcept;
+        static constexpr double cdf(int x) noexcept;
+        static constexpr double ccdf(int x) noexcept;
+        static constexpr count_type total() noexcept { return counts[table_size]; }
+        static Dice dice() { Dice d(N, F); d += Add; return d; }
+        static std::string str() { return dice().str(); }
+
+        // counts[k] is the number of ways of rolling min()+k, and
+        // cumulative[k] the number of ways of rolling less than that; the
+        // last element of each is the total
+
+        static constexpr auto counts = Detail::static_dice_table<N, F>(false);
+        static constexpr auto cumulative = Detail::static_dice_table<N, F>(true);
+
+    };
+
+        template <int N, int F, int Add>
+        template <typename RNG>
+        int StaticDice<N, F, Add>::operator()(RNG& rng) const {
+            if constexpr (Detail::is_word_rng<RNG> && N >= Detail::simd_dice_threshold) {
+                return Detail::sum_uniform(rng, N, F) + Add;
+            } else {
+                Sci::UniformInteger<int> one_dice(1, F);
+                int sum = Add;
+                for (int i = 0; i < N; ++i)
+                    sum += one_dice(rng);
+                return sum;
+            }
+        }
+
+        template <int N, int F, int Add>
+        constexpr double StaticDice<N, F, Add>::pdf(int x) noexcept {
+            if (x < min() || x > max())
+                return 0;
+            return double(counts[x - min()]) / double(total());
+        }
+
+        template <int N, int F, int Add>
+        constexpr double StaticDice<N, F, Add>::cdf(int x) noexcept {
+            if (x < min())
+                return 0;
+            if (x >= max())
+                return 1;
+            return double(cumulative[x - min() + 1]) / double(total());
+        }
+
+        template <int N, int F, int Add>
+        constexpr double StaticDice<N, F, Add>::ccdf(int x) noexcept {
+            if (x <= min())
+                return 1;
+            if (x > max())
+                return 0;
+            return double(total() - cumulative[x - min()]) / double(total());
+        }
+
+    class EmpiricalDistribution {
+
+    public:
+
+        EmpiricalDistribution() = default;
+
+        size_t trials() const noexcept { return trials_; }
+        Sci::Rational min() const noexcept { return values_.empty() ? Sci::Rational() : values_.front(); }
+        Sci::Rational max() const noexcept { return values_.empty() ? Sci::Rational() : values_.back(); }
+        double mean() const noexcept { return mean_; }
+        double variance() const noexcept { return variance_; }
+        double sd() const noexcept { using std::sqrt; return sqrt(variance_); }
+        double pdf(const Sci::Rational& x) const;
+        double cdf(const Sci::Rational& x) const;
+        double ccdf(const Sci::Rational& x) const;
+        double distance(const Dice& d) const;
+        const std::map<Sci::Rational, size_t>& counts() const noexcept { return counts_; }
+
+    private:
+
+        friend class DiceSimulator;
+
+        std::map<Sci::Rational, size_t> counts_;
+        std::vector<Sci::Rational> values_;
+        std::vector<size_t> cumulative_;
+        size_t trials_ = 0;
+        double mean_ = 0;
+        double variance_ = 0;
+
+        explicit EmpiricalDistribution(std::map<Sci::Rational, size_t>&& counts);
+
+    };
+
+    class DiceSimulator {
+
+    public:
+
+        static constexpr size_t chunk_size = 65'536;
+
+        DiceSimulator(): DiceSimulator(0) {}
+        explicit DiceSimulator(size_t threads, std::uint64_t seed = 0);
+
+        EmpiricalDistribution operator()(const Dice& d, size_t trials) const;
+        template <typename F> EmpiricalDistribution operator()(const F& f, size_t trials) const;
+
+        size_t threads() const noexcept { return threads_; }
+        std::uint64_t seed() const noexcept { return seed_; }
+
+    private:
+
+        size_t threads_;
+        std::uint64_t seed_;
+
+        template <typename Histogram, typename Task> std::vector<Histogram> run(size_t trials, Task task) const;
 
     };
 
+        template <typename F>
+        EmpiricalDistribution DiceSimulator::operator()(const F& f, size_t trials) const {
+            using histogram = std::map<Sci::Rational, size_t>;
+            auto histograms = run<histogram>(trials, [&f] (StreamRng& rng, size_t n, histogram& h) {
+                for (size_t i = 0; i < n; ++i)
+                    ++h[Sci::Rational(f(rng))];
+            });
+            histogram merged;
+            for (auto& h: histograms)
+                for (auto& [x, n]: h)
+                    merged[x] += n;
+            return EmpiricalDistribution(std::move(merged));
+        }
+
+        template <typename Histogram, typename Task>
+        std::vector<Histogram> DiceSimulator::run(size_t trials, Task task) const {
+
+            // The trials are divided into fixed size chunks, each with its
+            // own RNG stream numbered by the chunk, which the workers take
+            // in turn. Each worker counts its results in its own histogram,
+            // and the histograms are merged at the end, so the result
+            // depends only on the seed, not on the number of threads.
+
+            size_t chunks = (trials + chunk_size - 1) / chunk_size;
+            size_t workers = std::max(std::min({threads_, Detail::hardware_threads(), chunks}), size_t(1));
+            std::vector<Histogram> histograms(workers);
+
+            Detail::parallel_for(chunks, workers, [&] (size_t chunk, size_t w) {
+                StreamRng rng(seed_, chunk);
+                task(rng, std::min(chunk_size, trials - chunk * chunk_size), histograms[w]);
+            });
+
+            return histograms;
+
+        }
+
     inline Dice operator+(const Dice& a, const Dice& b) { auto d = a; d += b; return d; }
     inline Dice operator+(const Dice& a, const Sci::Rational& b) { auto d = a; d += b; return d; }
     inline Dice operator+(const Dice& a, int b) { auto d = a; d += b; return d; }
@@ -156,8 +1159,14 @@ namespace RS::Game {
     inline IntDice operator*(int a, const IntDice& b) { auto d = b; d *= a; return d; }
     inline IntDice operator/(const IntDice& a, int b) { auto d = a; d /= b; return d; }
 
+    inline DicePool operator+(const DicePool& a, const DicePool& b) { auto d = a; d += b; return d; }
+    inline DicePool operator+(const DicePool& a, int b) { auto d = a; d += b; return d; }
+    inline DicePool operator+(int a, const DicePool& b) { auto d = b; d += a; return d; }
+    inline DicePool operator-(const DicePool& a, int b) { auto d = a; d -= b; return d; }
+
     inline std::ostream& operator<<(std::ostream& out, const Dice& d) { return out << d.str(); }
     inline std::ostream& operator<<(std::ostream& out, const IntDice& d) { return out << d.str(); }
+    inline std::ostream& operator<<(std::ostream& out, const DicePool& d) { return out << d.str(); }
 
     namespace Literals {
 
@@ -171,7 +1180,8 @@ namespace RS::Game {
         inline Dice operator""_d30(unsigned long long n) { return Dice(int(n), 30); }
         inline Dice operator""_d100(unsigned long long n) { return Dice(int(n), 100); }
         inline Dice operator""_d1000(unsigned long long n) { return Dice(int(n), 1000); }
-        inline Dice operator""_dice(const char* p, size_t n) { return Dice(std::string(p, n)); }
+        inline Dice operator""_dF(unsigned long long n) { return Dice(int(n), {-1, 0, 1}); }
+        inline Dice operator""_dice(const char* p, size_t n) { return Dice(std::string_view(p, n)); }
 
         inline IntDice operator""_id3(unsigned long long n) { return IntDice(int(n), 3); }
         inline IntDice operator""_id4(unsigned long long n) { return IntDice(int(n), 4); }
@@ -183,7 +1193,7 @@ namespace RS::Game {
         inline IntDice operator""_id30(unsigned long long n) { return IntDice(int(n), 30); }
         inline IntDice operator""_id100(unsigned long long n) { return IntDice(int(n), 100); }
         inline IntDice operator""_id1000(unsigned long long n) { return IntDice(int(n), 1000); }
-        inline IntDice operator""_idice(const char* p, size_t n) { return IntDice(std::string(p, n)); }
+        inline IntDice operator""_idice(const char* p, size_t n) { return IntDice(std::string_view(p, n)); }
 
     }
 
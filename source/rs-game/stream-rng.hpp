@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace RS::Game {
+
+    // Counter based generator using the Philox4x32-10 bijection (Salmon et
+    // al, "Parallel Random Numbers: As Easy as 1, 2, 3", 2011). The seed is
+    // the key, and the 128-bit counter holds the stream number in the high
+    // 64 bits and the block number in the low 64 bits; each block yields
+    // two 64-bit results.
+
+    class StreamRng {
+
+    public:
+
+        using result_type = std::uint64_t;
+
+        constexpr StreamRng() noexcept: StreamRng(0) {}
+        constexpr explicit StreamRng(std::uint64_t seed, std::uint64_t stream = 0) noexcept:
+            key_(seed), stream_(stream) {}
+
+        constexpr std::uint64_t operator()() noexcept;
+
+        constexpr void seed(std::uint64_t seed, std::uint64_t stream = 0) noexcept { *this = StreamRng(seed, stream); }
+        constexpr void discard(unsigned long long n) noexcept;
+        constexpr void jump() noexcept;
+        constexpr StreamRng stream(std::uint64_t k) const noexcept { return StreamRng(key_, k); }
+        constexpr std::uint64_t stream() const noexcept { return stream_; }
+
+        static constexpr std::uint64_t min() noexcept { return 0; }
+        static constexpr std::uint64_t max() noexcept { return ~ std::uint64_t(0); }
+
+        static constexpr std::array<std::uint32_t, 4> philox(std::array<std::uint32_t, 4> counter,
+            std::array<std::uint32_t, 2> key) noexcept;
+
+        friend constexpr bool operator==(const StreamRng& a, const StreamRng& b) noexcept {
+            return a.key_ == b.key_ && a.stream_ == b.stream_ && a.block_ == b.block_ && a.index_ == b.index_;
+        }
+
+        friend constexpr bool operator!=(const StreamRng& a, const StreamRng& b) noexcept {
+            return ! (a == b);
+        }
+
+    private:
+
+        std::uint64_t key_;
+        std::uint64_t stream_;
+        std::uint64_t block_ = 0; // next block to generate
+        std::uint64_t buffer_[2] = {0, 0};
+        int index_ = 2; // next result in the buffer
+
+        constexpr void generate() noexcept;
+
+    };
+
+        constexpr std::uint64_t StreamRng::operator()() noexcept {
+            if (index_ == 2)
+                generate();
+            return buffer_[index_++];
+        }
+
+        constexpr void StreamRng::discard(unsigned long long n) noexcept {
+
+            // The counter makes this constant time: find the new position,
+            // and generate its block if it starts partway through one
+
+            auto position = index_ == 2 ? 2 * block_ : 2 * (block_ - 1) + index_;
+            position += n;
+            block_ = position / 2;
+            index_ = 2;
+
+            if (position % 2 != 0) {
+                generate();
+                index_ = 1;
+            }
+
+        }
+
+        constexpr void StreamRng::jump() noexcept {
+
+            // If the position is partway through a block, the buffered
+            // results belong to the old stream, so regenerate the block
+
+            ++stream_;
+
+            if (index_ != 2) {
+                auto index = index_;
+                --block_;
+                generate();
+                index_ = index;
+            }
+
+        }
+
+        constexpr void StreamRng::generate() noexcept {
+            auto x = philox({{std::uint32_t(block_), std::uint32_t(block_ >> 32), std::uint32_t(stream_), std::uint32_t(stream_ >> 32)}},
+                {{std::uint32_t(key_), std::uint32_t(key_ >> 32)}});
+            buffer_[0] = std::uint64_t(x[0]) | (std::uint64_t(x[1]) << 32);
+            buffer_[1] = std::uint64_t(x[2]) | (std::uint64_t(x[3]) << 32);
+            ++block_;
+            index_ = 0;
+        }
+
+        constexpr std::array<std::uint32_t, 4> StreamRng::philox(std::array<std::uint32_t, 4> counter,
+                std::array<std::uint32_t, 2> key) noexcept {
+
+            constexpr std::uint64_t m0 = 0xd251'1f53;
+            constexpr std::uint64_t m1 = 0xcd9e'8d57;
+            constexpr std::uint32_t w0 = 0x9e37'79b9;
+            constexpr std::uint32_t w1 = 0xbb67'ae85;
+
+            auto& c = counter;
+
+            for (int i = 0; i < 10; ++i) {
+                if (i > 0) {
+                    key[0] += w0;
+                    key[1] += w1;
+                }
+                auto p0 = m0 * c[0];
+                auto p1 = m1 * c[2];
+                c = {{std::uint32_t(p1 >> 32) ^ c[1] ^ key[0], std::uint32_t(p1),
+                    std::uint32_t(p0 >> 32) ^ c[3] ^ key[1], std::uint32_t(p0)}};
+            }
+
+            return counter;
+
+        }
+
+}
@@ -2,6 +2,7 @@
 
 #include "rs-sci/random.hpp"
 #include "rs-tl/enum.hpp"
+#include <cstdint>
 #include <functional>
 #include <initializer_list>
 #include <memory>
@@ -56,6 +57,7 @@ namespace RS::Game {
         TextGen(char32_t c);
 
         std::string operator()(Sci::StdRng& rng) const;
+        template <typename RNG> std::string operator()(RNG& rng) const;
 
         void set(option opt);
 
@@ -79,6 +81,21 @@ namespace RS::Game {
 
     RS_DEFINE_BITMASK_OPERATORS(TextGen::option)
 
+        template <typename RNG>
+        std::string TextGen::operator()(RNG& rng) const {
+
+            // The generator tree needs a concrete RNG type, so any other RNG
+            // seeds a local one, taking 64 bits from it for each call
+
+            std::uint64_t seed = rng();
+            if constexpr (std::uint64_t(RNG::max()) <= 0xffff'ffffull)
+                seed = (seed << 32) ^ std::uint64_t(rng());
+            Sci::StdRng local(seed);
+
+            return (*this)(local);
+
+        }
+
     namespace Detail {
 
         class TextBase {
@@ -2,7 +2,15 @@
 #include "rs-sci/rational.hpp"
 #include "rs-sci/statistics.hpp"
 #include "rs-unit-test.hpp"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <numeric>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace RS::Game;
 using namespace RS::Game::Literals;
@@ -112,6 +120,22 @@ void test_rs_game_dice_parser() {
     TEST_EQUAL(d.mean(), Rational(357,8));
     TEST_NEAR(d.sd(), 12.321433, 1e-6);
 
+    TRY(d = Dice("2X3D + 1 0 / 4"));
+    TEST_EQUAL(d.str(), "3d6*2+5/2");
+
+    TEST_THROW(Dice("+"), std::invalid_argument);
+    TEST_THROW(Dice("3d6+"), std::invalid_argument);
+    TEST_THROW(Dice("3d6*"), std::invalid_argument);
+    TEST_THROW(Dice("3d6/"), std::invalid_argument);
+    TEST_THROW(Dice("2x3"), std::invalid_argument);
+    TEST_THROW(Dice("*d6"), std::invalid_argument);
+    TEST_THROW(Dice("3d6 d8"), std::invalid_argument);
+    TEST_THROW(Dice("3d6+abc"), std::invalid_argument);
+    TEST_THROW(Dice("+-3d6"), std::invalid_argument);
+    TEST_THROW(Dice("2147483648"), std::invalid_argument);
+    TEST_THROW(Dice("99999999999d6"), std::invalid_argument);
+    TEST_THROW(Dice("3d99999999999"), std::invalid_argument);
+
 }
 
 void test_rs_game_dice_generation() {
@@ -165,6 +189,74 @@ void test_rs_game_dice_generation() {
 
 }
 
+void test_rs_game_dice_vectorized_generation() {
+
+    // The mt19937 engines produce full 32 or 64 bit words and take the
+    // vectorized path; minstd_rand does not, and takes the scalar path
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    Dice d;
+    std::mt19937 rng32(42);
+    std::mt19937_64 rng64(42);
+    std::minstd_rand rng31(42);
+    Statistics<double> stats32, stats64;
+    std::map<int, int> census32, census64, census31;
+    Rational x;
+
+    TRY(d = Dice("10d6"));
+
+    for (int i = 0; i < iterations; ++i) {
+        ++census32[d(rng32).floor()];
+        ++census64[d(rng64).floor()];
+    }
+
+    for (int i = 10; i <= 60; ++i) {
+        TEST_NEAR(double(census32[i]) / iterations, double(d.pdf(i)), 0.005);
+        TEST_NEAR(double(census64[i]) / iterations, double(d.pdf(i)), 0.005);
+    }
+
+    census32.clear();
+    census64.clear();
+    TRY(d = Dice("100d6+70d20"));
+
+    for (int i = 0; i < iterations; ++i) {
+        TRY(x = d(rng32));
+        TRY(stats32(double(x)));
+        ++census32[x.floor()];
+        TRY(x = d(rng64));
+        TRY(stats64(double(x)));
+        ++census64[x.floor()];
+        ++census31[d(rng31).floor()];
+    }
+
+    TEST_COMPARE(stats32.min(), >=, double(d.min()));
+    TEST_COMPARE(stats32.max(), <=, double(d.max()));
+    TEST_NEAR(stats32.mean(), double(d.mean()), 10 * tolerance);
+    TEST_NEAR(stats32.sd(), d.sd(), 10 * tolerance);
+    TEST_COMPARE(stats64.min(), >=, double(d.min()));
+    TEST_COMPARE(stats64.max(), <=, double(d.max()));
+    TEST_NEAR(stats64.mean(), double(d.mean()), 10 * tolerance);
+    TEST_NEAR(stats64.sd(), d.sd(), 10 * tolerance);
+
+    // Two-sample Kolmogorov-Smirnov comparison with the scalar path
+
+    double cdf32 = 0, cdf64 = 0, cdf31 = 0, ks32 = 0, ks64 = 0;
+
+    for (int i = d.min().floor(); i <= d.max().floor(); ++i) {
+        cdf32 += double(census32[i]) / iterations;
+        cdf64 += double(census64[i]) / iterations;
+        cdf31 += double(census31[i]) / iterations;
+        ks32 = std::max(ks32, std::abs(cdf32 - cdf31));
+        ks64 = std::max(ks64, std::abs(cdf64 - cdf31));
+    }
+
+    TEST_COMPARE(ks32, <, 0.01);
+    TEST_COMPARE(ks64, <, 0.01);
+
+}
+
 void test_rs_game_dice_literals() {
 
     Dice d;
@@ -252,6 +344,1252 @@ void test_rs_game_dice_pdf() {
 
 }
 
+void test_rs_game_dice_batch_generation() {
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    Dice d;
+    std::minstd_rand rng(42);
+    Statistics<double> stats;
+    std::vector<Rational> results(iterations);
+
+    TRY(d = Dice("2d10-2d6/4+10"));
+    TRY(d.roll_n(rng, results.data(), results.size()));
+
+    for (auto& x: results)
+        TRY(stats(double(x)));
+
+    TEST_EQUAL(stats.min(), double(d.min()));
+    TEST_EQUAL(stats.max(), double(d.max()));
+    TEST_NEAR(stats.mean(), double(d.mean()), tolerance);
+    TEST_NEAR(stats.sd(), d.sd(), tolerance);
+
+    TRY(d = Dice());
+    TRY(d.roll_n(rng, results.data(), 10));
+    for (int i = 0; i < 10; ++i)
+        TEST_EQUAL(results[i], 0);
+
+}
+
+void test_rs_game_dice_mixed_pdf() {
+
+    Dice d;
+    Rational sum, mean;
+
+    TRY(d = Dice("3d6+2d8+d20-5"));
+    TEST_EQUAL(d.min(), 1);
+    TEST_EQUAL(d.max(), 49);
+
+    TEST_EQUAL(d.pdf(0),   0);                    TEST_EQUAL(d.cdf(0),   0);                       TEST_EQUAL(d.ccdf(0),   1);
+    TEST_EQUAL(d.pdf(1),   Rational(1, 276480));  TEST_EQUAL(d.cdf(1),   Rational(1, 276480));     TEST_EQUAL(d.ccdf(1),   1);
+    TEST_EQUAL(d.pdf(2),   Rational(6, 276480));  TEST_EQUAL(d.cdf(2),   Rational(7, 276480));     TEST_EQUAL(d.ccdf(2),   Rational(276479, 276480));
+    TEST_EQUAL(d.pdf(49),  Rational(1, 276480));  TEST_EQUAL(d.cdf(49),  1);                       TEST_EQUAL(d.ccdf(49),  Rational(1, 276480));
+    TEST_EQUAL(d.pdf(50),  0);                    TEST_EQUAL(d.cdf(50),  1);                       TEST_EQUAL(d.ccdf(50),  0);
+
+    for (int x = 1; x <= 49; ++x) {
+        sum += d.pdf(x);
+        mean += x * d.pdf(x);
+    }
+
+    TEST_EQUAL(sum, 1);
+    TEST_EQUAL(mean, d.mean());
+
+    TRY(d = Dice("2d6*3-d4/2"));
+
+    TEST_EQUAL(d.pdf(Rational(4)),     Rational(1, 144));
+    TEST_EQUAL(d.pdf(Rational(11,2)),  Rational(1, 144));
+    TEST_EQUAL(d.pdf(Rational(35,2)),  Rational(5, 144));
+    TEST_EQUAL(d.cdf(Rational(35,2)),  Rational(60, 144));
+    TEST_EQUAL(d.pdf(Rational(18)),    0);
+    TEST_EQUAL(d.pdf(Rational(71,2)),  Rational(1, 144));
+
+    std::map<Rational, Rational> table;
+
+    TRY(d = 2_d6 * 3);
+    TEST_EQUAL(d.pdf(6),  Rational(1, 36));  TEST_EQUAL(d.cdf(6),  Rational(1, 36));  TEST_EQUAL(d.ccdf(6),  1);
+    TEST_EQUAL(d.pdf(7),  0);                TEST_EQUAL(d.cdf(7),  Rational(1, 36));  TEST_EQUAL(d.ccdf(7),  Rational(35, 36));
+    TEST_EQUAL(d.pdf(8),  0);                TEST_EQUAL(d.cdf(8),  Rational(1, 36));  TEST_EQUAL(d.ccdf(8),  Rational(35, 36));
+    TEST_EQUAL(d.pdf(9),  Rational(2, 36));  TEST_EQUAL(d.cdf(9),  Rational(3, 36));  TEST_EQUAL(d.ccdf(9),  Rational(35, 36));
+
+    TRY(table = d.table());
+    TEST_EQUAL(table.size(), 11u);
+    TEST_EQUAL(table.begin()->first, 6);
+    TEST_EQUAL(table.begin()->second, Rational(1, 36));
+    TEST_EQUAL(table.rbegin()->first, 36);
+    TEST_EQUAL(table[21], Rational(6, 36));
+
+}
+
+void test_rs_game_dice_large_pools() {
+
+    Dice d;
+
+    TRY(d = 10_d6);
+    TEST_EQUAL(d.pdf(10),  Rational(1, 60466176));
+    TEST_EQUAL(d.pdf(35),  Rational(7631, 104976));
+    TEST_EQUAL(d.cdf(35),  Rational(112607, 209952));
+    TEST_EQUAL(d.ccdf(35), Rational(112607, 209952));
+    TEST_EQUAL(d.pdf(60),  Rational(1, 60466176));
+
+    TRY(d = 7_d20);
+    TEST_EQUAL(d.pdf(7),   Rational(1, 1280000000));
+    TEST_EQUAL(d.pdf(74),  Rational(409087, 16000000));
+    TEST_EQUAL(d.cdf(73),  Rational(1, 2));
+    TEST_EQUAL(d.pdf(140), Rational(1, 1280000000));
+
+    TRY(d = 20_d20);
+    TEST_NEAR(double(d.pdf(210)), 0.015353287451, 1e-12);
+    TEST_NEAR(double(d.cdf(210)), 0.507676643726, 1e-12);
+    TEST_EQUAL(d.pdf(20), 0);
+    TEST_EQUAL(d.cdf(400), 1);
+
+    TRY(d = Dice("12d100"));
+    TEST_NEAR(double(d.pdf(606)), 0.003939442934, 1e-12);
+    TEST_NEAR(double(d.cdf(606)), 0.501969721467, 1e-12);
+
+    // Too many outcomes to count, even in 128 bits
+
+    TableDice t;
+    Dice::comparison c;
+
+    TRY(d = Dice("30d20"));
+    TEST_NEAR(double(d.pdf(315)), 0.012567832646, 1e-12);
+    TEST_NEAR(double(d.cdf(315)), 0.506283916323, 1e-12);
+    TEST_NEAR(double(d.ccdf(316)), 0.493716083677, 1e-12);
+    TEST_EQUAL(d.pdf(30), 0);
+    TEST_EQUAL(d.cdf(600), 1);
+    TEST_EQUAL(d.ccdf(30), 1);
+    TEST_EQUAL(d.quantile(Rational(1, 2)), 315);
+    TRY(t = TableDice(d));
+    TEST_EQUAL(t.pdf(315), d.pdf(315));
+    TEST_EQUAL(t.cdf(315), d.cdf(315));
+    TEST_EQUAL(t.ccdf(316), d.ccdf(316));
+    TRY(c = Dice::compare(d, d));
+    TEST_NEAR(double(c.tie), 0.008909323067, 1e-9);
+    TEST_NEAR(double(c.win), 0.495545338467, 1e-9);
+    TEST_NEAR(double(c.loss), 0.495545338467, 1e-9);
+    TRY(t = Dice::max_of({d, Dice("315")}));
+    TEST_EQUAL(t.min(), 315);
+    TEST_NEAR(double(t.pdf(315)), 0.506283916323, 1e-12);
+
+}
+
+void test_rs_game_dice_concurrent_pdf() {
+
+    static constexpr int threads = 8;
+
+    Dice d = 3_d6 + 2_d8;
+    std::vector<std::thread> workers;
+    std::vector<Rational> sums(threads);
+
+    for (int i = 0; i < threads; ++i)
+        workers.emplace_back([&d,&sums,i] {
+            for (int x = 5; x <= 34; ++x)
+                sums[i] += d.pdf(x);
+        });
+
+    for (auto& t: workers)
+        t.join();
+
+    for (auto& sum: sums)
+        TEST_EQUAL(sum, 1);
+
+}
+
+void test_rs_game_dice_compare() {
+
+    Dice::comparison c;
+    std::vector<Dice::comparison> v;
+
+    TRY(c = Dice::compare(1_d6, 1_d6));
+    TEST_EQUAL(c.win, Rational(5, 12));
+    TEST_EQUAL(c.tie, Rational(1, 6));
+    TEST_EQUAL(c.loss, Rational(5, 12));
+
+    TRY(c = Dice::compare(2_d6, 1_d12));
+    TEST_EQUAL(c.win, Rational(1, 2));
+    TEST_EQUAL(c.tie, Rational(1, 12));
+    TEST_EQUAL(c.loss, Rational(5, 12));
+
+    TRY(c = Dice::compare(3_d6, Dice("2d10/2+3")));
+    TEST_EQUAL(c.win, Rational(3683, 5400));
+    TEST_EQUAL(c.tie, Rational(101, 2160));
+    TEST_EQUAL(c.loss, Rational(2929, 10800));
+
+    TRY(c = Dice::compare(1_d20 + 5, Dice("15")));
+    TEST_EQUAL(c.win, Rational(1, 2));
+    TEST_EQUAL(c.tie, Rational(1, 20));
+    TEST_EQUAL(c.loss, Rational(9, 20));
+
+    TRY(c = Dice::compare(Dice(), 1_d6));
+    TEST_EQUAL(c.win, 0);
+    TEST_EQUAL(c.tie, 0);
+    TEST_EQUAL(c.loss, 1);
+
+    TRY(c = Dice::compare(Dice(), Dice()));
+    TEST_EQUAL(c.tie, 1);
+
+    TRY(v = Dice::compare(1_d6, {1_d4, 1_d6, 1_d8}));
+    TEST_EQUAL(v.size(), 3u);
+    TEST_EQUAL(v[0].win, Rational(7, 12));   TEST_EQUAL(v[0].tie, Rational(1, 6));  TEST_EQUAL(v[0].loss, Rational(1, 4));
+    TEST_EQUAL(v[1].win, Rational(5, 12));   TEST_EQUAL(v[1].tie, Rational(1, 6));  TEST_EQUAL(v[1].loss, Rational(5, 12));
+    TEST_EQUAL(v[2].win, Rational(5, 16));   TEST_EQUAL(v[2].tie, Rational(1, 8));  TEST_EQUAL(v[2].loss, Rational(9, 16));
+
+}
+
+void test_rs_game_dice_quantile() {
+
+    Dice d;
+    Rational x;
+
+    TRY(x = d.quantile(Rational(1, 2)));
+    TEST_EQUAL(x, 0);
+
+    TRY(d = 3_d6);
+    TEST_EQUAL(d.quantile(0), 3);
+    TEST_EQUAL(d.quantile(Rational(1, 216)), 3);
+    TEST_EQUAL(d.quantile(Rational(2, 216)), 4);
+    TEST_EQUAL(d.quantile(Rational(1, 2)), 10);
+    TEST_EQUAL(d.quantile(Rational(95, 100)), 15);
+    TEST_EQUAL(d.quantile(1), 18);
+
+    TRY(d = 2_d10 / 2);
+    TEST_EQUAL(d.quantile(Rational(1, 2)), Rational(11, 2));
+
+    TEST_THROW(d.quantile(Rational(-1, 2)), std::invalid_argument);
+    TEST_THROW(d.quantile(Rational(3, 2)), std::invalid_argument);
+
+    std::vector<Rational> p, q;
+
+    for (int i = 0; i <= 1000; ++i)
+        p.push_back(Rational(i, 1000));
+
+    q.resize(p.size());
+    TRY(d = Dice("2d10-2d6+10"));
+    TRY(d.quantiles(p.data(), q.data(), p.size()));
+
+    for (size_t i = 0; i < p.size(); ++i) {
+        x = d.min();
+        while (d.cdf(x) < p[i])
+            x += 1;
+        TEST_EQUAL(q[i], x);
+    }
+
+}
+
+void test_rs_game_dice_arrays() {
+
+    Dice d;
+    Dice::distribution_arrays<Rational> exact;
+    Dice::distribution_arrays<double> approx;
+
+    TRY(exact = d.arrays<Rational>());
+    TEST_EQUAL(exact.values.size(), 1u);
+    TEST_EQUAL(exact.pdf.size(), 1u);
+
+    TRY(d = 2_d6 * 3 - Rational(1, 2));
+    TRY(exact = d.arrays<Rational>());
+    TRY(approx = d.arrays<double>());
+    TEST_EQUAL(exact.values.size(), 11u);
+    TEST_EQUAL(approx.values.size(), 11u);
+    TEST_EQUAL(exact.values.front(), Rational(11, 2));
+    TEST_EQUAL(exact.values.back(), Rational(71, 2));
+
+    for (size_t i = 0; i < exact.values.size(); ++i) {
+        auto x = exact.values[i];
+        TEST_EQUAL(exact.pdf[i], d.pdf(x));
+        TEST_EQUAL(exact.cdf[i], d.cdf(x));
+        TEST_EQUAL(exact.ccdf[i], d.ccdf(x));
+        TEST_EQUAL(approx.values[i], double(x));
+        TEST_NEAR(approx.pdf[i], double(d.pdf(x)), 1e-12);
+        TEST_NEAR(approx.cdf[i], double(d.cdf(x)), 1e-12);
+        TEST_NEAR(approx.ccdf[i], double(d.ccdf(x)), 1e-12);
+    }
+
+    TRY(d = Dice("2d6*2+d4"));
+    TRY(exact = d.arrays<Rational>());
+    TEST_EQUAL(exact.values.size(), 24u);
+    TEST_EQUAL(exact.pdf[1], Rational(1, 144));
+    TEST_EQUAL(exact.pdf[3], Rational(1, 48));
+
+    TRY(d = 20_d6);
+    TRY(exact = d.arrays<Rational>());
+    TEST_EQUAL(exact.values.size(), 101u);
+    TEST_NEAR(double(exact.pdf[50]), 0.051819, 1e-6);
+    TEST_EQUAL(exact.cdf.back(), 1);
+    TEST_EQUAL(exact.ccdf.front(), 1);
+    TRY(approx = d.arrays<double>());
+    TEST_EQUAL(approx.values.size(), 101u);
+    TEST_NEAR(std::accumulate(approx.pdf.begin(), approx.pdf.end(), 0.0), 1, 1e-12);
+    TEST_NEAR(approx.pdf[50], 0.051819, 1e-6);
+    TEST_EQUAL(approx.cdf.back(), 1);
+    TEST_EQUAL(approx.ccdf.front(), 1);
+
+}
+
+void test_rs_game_dice_approximation() {
+
+    Dice d;
+    Dice::distribution_arrays<double> exact;
+    double p = 0, q = 0;
+
+    TEST_EQUAL(d.approx_pdf(0), 0);
+    TEST_EQUAL(d.approx_cdf(0), 0);
+
+    TRY(d = Dice("3d6+2d10/2+4d6kh3"));
+    TRY(exact = d.arrays<double>());
+
+    for (size_t i = 0; i < exact.values.size(); ++i) {
+        auto x = Rational(int(exact.values[i] * 2), 2);
+        TEST_NEAR(d.approx_pdf(x), exact.pdf[i], 1e-12);
+        TEST_NEAR(d.approx_cdf(x), exact.cdf[i], 1e-12);
+        TEST_NEAR(d.approx_ccdf(x), exact.ccdf[i], 1e-12);
+    }
+
+    TEST_EQUAL(d.approx_pdf(Rational(17, 4)), 0);
+    TEST_EQUAL(d.approx_cdf(0), 0);
+    TEST_EQUAL(d.approx_cdf(1000), 1);
+    TEST_EQUAL(d.approx_ccdf(0), 1);
+    TEST_EQUAL(d.approx_ccdf(1000), 0);
+
+    TRY(d = Dice("2d6!+d8"));
+    TRY(exact = d.arrays<double>());
+    for (size_t i = 0; i < exact.values.size(); i += 7)
+        TEST_NEAR(d.approx_pdf(int(exact.values[i])), exact.pdf[i], 1e-12);
+
+    TRY(d = 20_d6);
+    TRY(exact = d.arrays<double>());
+    for (size_t i = 0; i < exact.values.size(); ++i)
+        TEST_NEAR(d.approx_cdf(int(exact.values[i])), exact.cdf[i], 1e-12);
+
+    TRY(d = Dice("200d100+50d20*3"));
+    TEST_EQUAL(d.normal_limit(), 1u << 20);
+    TRY(p = d.approx_pdf(11675));
+    TEST_NEAR(p, 0.000936, 1e-6);
+    TRY(q = d.approx_cdf(11675));
+    TEST_NEAR(q - p / 2, 0.5, 1e-12);
+    TRY(p = d.approx_ccdf(11676));
+    TEST_NEAR(p + q, 1, 1e-12);
+
+    TRY(p = 0);
+    for (int x = 0; x <= 23000; ++x)
+        p += d.approx_pdf(x);
+    TEST_NEAR(p, 1, 1e-12);
+
+    Dice e = d;
+    TRY(e.set_normal_limit(1000));
+    TEST_EQUAL(e.normal_limit(), 1000u);
+    TEST_EQUAL(d.normal_limit(), 1u << 20);
+    TEST_NEAR(e.approx_pdf(11000), d.approx_pdf(11000), 1e-6);
+    TEST_NEAR(e.approx_cdf(11000), d.approx_cdf(11000), 1e-3);
+    TEST_NEAR(e.approx_ccdf(12500), d.approx_ccdf(12500), 1e-3);
+    TEST_EQUAL(e.approx_pdf(349), 0);
+    TEST_EQUAL(e.approx_cdf(349), 0);
+    TEST_EQUAL(e.approx_cdf(30000), 1);
+
+    TRY(d = Dice("d6+5"));
+    TRY(d.set_normal_limit(0));
+    TEST_NEAR(d.approx_cdf(8), 0.5, 1e-12);
+    TEST_NEAR(d.approx_ccdf(9), 0.5, 1e-12);
+
+}
+
+void test_rs_game_dice_table_cache() {
+
+    Dice a, b, c;
+
+    TRY(Dice::set_cache_limit(2));
+    TRY(Dice::clear_cache());
+    TEST_EQUAL(Dice::cache_size(), 0u);
+
+    TRY(a = Dice("3d6"));
+    TEST_EQUAL(a.pdf(10), Rational(27, 216));
+    TEST_EQUAL(Dice::cache_hits(), 0u);
+    TEST_EQUAL(Dice::cache_misses(), 1u);
+    TEST_EQUAL(Dice::cache_size(), 1u);
+
+    TRY(b = Dice("3D6"));
+    TEST_EQUAL(b.pdf(10), Rational(27, 216));
+    TEST_EQUAL(Dice::cache_hits(), 1u);
+    TEST_EQUAL(Dice::cache_misses(), 1u);
+    TEST_EQUAL(Dice::cache_size(), 1u);
+
+    TRY(c = 2_d6 + 1_d6);
+    TEST_EQUAL(c.pdf(10), Rational(27, 216));
+    TEST_EQUAL(Dice::cache_hits(), 2u);
+    TEST_EQUAL(Dice::cache_misses(), 1u);
+
+    TRY(a = Dice("2d8"));
+    TEST_EQUAL(a.pdf(9), Rational(8, 64));
+    TRY(b = Dice("2d10"));
+    TEST_EQUAL(b.pdf(11), Rational(10, 100));
+    TEST_EQUAL(Dice::cache_misses(), 3u);
+    TEST_EQUAL(Dice::cache_size(), 2u);
+
+    TRY(c = Dice("3d6"));
+    TEST_EQUAL(c.pdf(10), Rational(27, 216));
+    TEST_EQUAL(Dice::cache_hits(), 2u);
+    TEST_EQUAL(Dice::cache_misses(), 4u);
+    TEST_EQUAL(Dice::cache_size(), 2u);
+
+    TRY(Dice::set_cache_limit(0));
+    TEST_EQUAL(Dice::cache_size(), 0u);
+    TRY(Dice::clear_cache());
+
+    TRY(a = Dice("3d6"));
+    TEST_EQUAL(a.pdf(10), Rational(27, 216));
+    TEST_EQUAL(Dice::cache_hits(), 0u);
+    TEST_EQUAL(Dice::cache_misses(), 0u);
+
+}
+
+void test_rs_game_dice_incremental_pdf() {
+
+    Dice d;
+
+    TRY(d = 2_d6);                TEST_EQUAL(d.pdf(7), Rational(6, 36));
+    TRY(d += 3);                  TEST(d.table() == Dice("2d6+3").table());
+    TRY(d += Dice(1, 4));         TEST(d.table() == Dice("2d6+d4+3").table());
+    TRY(d -= Rational(1, 2));     TEST(d.table() == Dice("2d6+d4+5/2").table());
+    TRY(d *= 2);                  TEST(d.table() == Dice("2d6*2+d4*2+5").table());
+    TRY(d -= Dice(1, 8, 3));      TEST(d.table() == Dice("2d6*2+d4*2-d8*3+5").table());
+    TRY(d *= Rational(-1, 3));    TEST(d.table() == Dice("-2d6*2/3-d4*2/3+d8-5/3").table());
+    TRY(d = - d);                 TEST(d.table() == Dice("2d6*2/3+d4*2/3-d8+5/3").table());
+    TRY(d += Dice("d10/2"));      TEST(d.table() == Dice("2d6*2/3+d4*2/3-d8+d10/2+5/3").table());
+    TRY(d += d);                  TEST(d.table() == Dice("4d6*2/3+2d4*2/3-2d8+2d10/2+10/3").table());
+    TRY(d *= 0);                  TEST(d.table() == Dice("0").table());
+
+    TRY(d = 3_d6);
+    TEST_EQUAL(d.pdf(10), Rational(27, 216));
+    TRY(d += Dice());
+    TEST(d.table() == Dice("3d6").table());
+    TRY(d = Dice() + d);
+    TEST(d.table() == Dice("3d6").table());
+    TEST_EQUAL(d.cdf(10), Rational(1, 2));
+    TEST_EQUAL(d.ccdf(11), Rational(1, 2));
+
+    // Only derived if the combined table can still be counted
+
+    TRY(d = 10_d6);
+    TEST_EQUAL(d.pdf(30), Rational(2930455, 60466176));
+    TRY(d += 15_d6);
+    TEST_EQUAL(d.pdf(80), Dice("25d6").pdf(80));
+    TRY(d = 10_d6);
+    TEST_EQUAL(d.pdf(30), Rational(2930455, 60466176));
+    TRY(d += Dice("20d20"));
+    TEST_EQUAL(d.pdf(30), Dice("10d6+20d20").pdf(30));
+    TEST_EQUAL(d.pdf(250), Dice("10d6+20d20").pdf(250));
+    TRY(d = 10_d6);
+    TEST_EQUAL(d.pdf(30), Rational(2930455, 60466176));
+    TRY(d += Dice("100d6kl2"));
+    TEST_EQUAL(d.pdf(32), Dice("10d6+100d6kl2").pdf(32));
+    TRY(d -= Dice("30d20"));
+    TEST_EQUAL(d.pdf(-280), Dice("10d6+100d6kl2-30d20").pdf(-280));
+
+}
+
+void test_rs_game_dice_parallel_tables() {
+
+    // The same tables must come out whether or not they are built in
+    // parallel; a threshold of 1 forces parallel construction whenever
+    // there is more than one group
+
+    static const std::vector<std::string> list = {
+        "d6",
+        "d4+d6",
+        "d4+d6+d8",
+        "2d6*2+d4-d8*3+5",
+        "4d6kh3+d{1:3,2}+2dF",
+        "d6!+d8/2+d10/3+d12/4+d20/5",
+        "4d6+3d8+2d10+d20*3+d12",
+        "12d6+12d6",
+    };
+
+    auto threshold = Dice::parallel_threshold();
+    Dice d;
+    Dice::distribution_arrays<double> serial, parallel;
+
+    TEST(threshold > 0);
+
+    for (auto& str: list) {
+        TRY(Dice::set_parallel_threshold(0));
+        TRY(d = Dice(str));
+        TRY(serial = d.arrays<double>());
+        TRY(Dice::set_parallel_threshold(1));
+        TEST_EQUAL(Dice::parallel_threshold(), 1u);
+        TRY(d = Dice(str));
+        TRY(parallel = d.arrays<double>());
+        TEST(parallel.values == serial.values);
+        TEST(parallel.pdf == serial.pdf);
+        TEST(parallel.cdf == serial.cdf);
+        TEST(parallel.ccdf == serial.ccdf);
+    }
+
+    TRY(d = Dice("13d6+12d6"));
+    TEST_EQUAL(d.pdf(80), Dice("25d6").pdf(80));
+    TEST_NEAR(double(d.pdf(80)), 0.031835, 1e-6);
+
+    TRY(Dice::set_parallel_threshold(threshold));
+    TEST_EQUAL(Dice::parallel_threshold(), threshold);
+
+}
+
+void test_rs_game_dice_table_generation() {
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    Dice d;
+    TableDice t;
+    std::minstd_rand rng(42);
+    Statistics<double> stats;
+    std::map<Rational, int> census;
+    Rational x;
+
+    for (int i = 0; i < 100; ++i) {
+        TRY(x = t(rng));
+        TEST_EQUAL(x, 0);
+    }
+
+    TRY(d = Dice("2d10-2d6+10"));
+    TRY(t = TableDice(d));
+    TEST_EQUAL(t.min(), d.min());
+    TEST_EQUAL(t.max(), d.max());
+
+    for (int i = 0; i < iterations; ++i) {
+        TRY(x = t(rng));
+        TRY(stats(double(x)));
+    }
+
+    TEST_EQUAL(stats.min(), double(d.min()));
+    TEST_EQUAL(stats.max(), double(d.max()));
+    TEST_NEAR(stats.mean(), double(d.mean()), tolerance);
+    TEST_NEAR(stats.sd(), d.sd(), tolerance);
+
+    stats = {};
+    TRY(d = Dice("20d6/2"));
+    TRY(t = TableDice(d));
+
+    for (int i = 0; i < iterations; ++i) {
+        TRY(x = t(rng));
+        TRY(stats(double(x)));
+    }
+
+    TEST_NEAR(stats.mean(), double(d.mean()), tolerance);
+    TEST_NEAR(stats.sd(), d.sd(), tolerance);
+
+    TRY(d = 3_d6);
+    TRY(t = TableDice(d));
+
+    for (int i = 0; i < iterations; ++i)
+        ++census[t(rng)];
+
+    for (int i = 3; i <= 18; ++i)
+        TEST_NEAR(double(census[i]) / iterations, double(d.pdf(i)), 0.005);
+
+}
+
+void test_rs_game_dice_extreme_of() {
+
+    static constexpr int iterations = 100'000;
+
+    Dice d;
+    TableDice t;
+    std::mt19937_64 rng(42);
+    std::map<Rational, int> census;
+
+    TEST_EQUAL(t.pdf(0), 1);
+    TEST_EQUAL(t.cdf(0), 1);
+    TEST_EQUAL(t.ccdf(0), 1);
+
+    TRY(d = Dice("2d10-2d6+10"));
+    TRY(t = TableDice(d));
+
+    for (int x = -1; x <= 30; ++x) {
+        TEST_EQUAL(t.pdf(x), d.pdf(x));
+        TEST_EQUAL(t.cdf(x), d.cdf(x));
+        TEST_EQUAL(t.ccdf(x), d.ccdf(x));
+    }
+
+    TRY(t = Dice::max_of({1_d20, 1_d20}));
+    TEST_EQUAL(t.min(), 1);
+    TEST_EQUAL(t.max(), 20);
+    TEST_EQUAL(t.pdf(1), Rational(1, 400));
+    TEST_EQUAL(t.pdf(20), Rational(39, 400));
+    TEST_EQUAL(t.cdf(10), Rational(1, 4));
+    TEST_EQUAL(t.ccdf(11), Rational(3, 4));
+
+    TRY(t = Dice::min_of({1_d20, 1_d20}));
+    TEST_EQUAL(t.pdf(1), Rational(39, 400));
+    TEST_EQUAL(t.pdf(20), Rational(1, 400));
+    TEST_EQUAL(t.cdf(10), Rational(3, 4));
+
+    TRY(t = Dice::max_of({1_d20 + 5, 1_d20 + 5, 1_d20 + 5}));
+    TEST_EQUAL(t.min(), 6);
+    TEST_EQUAL(t.max(), 25);
+    TEST_EQUAL(t.cdf(15), Rational(1, 8));
+
+    TRY(t = Dice::max_of({2_d6, 1_d12, Dice("7")}));
+    TEST_EQUAL(t.min(), 7);
+    TEST_EQUAL(t.max(), 12);
+    TEST_EQUAL(t.pdf(6), 0);
+    TEST_EQUAL(t.pdf(7), Rational(49, 144));
+    TEST_EQUAL(t.pdf(8), Rational(61, 432));
+    TEST_EQUAL(t.pdf(12), Rational(47, 432));
+
+    TRY(t = Dice::min_of({1_d6 / 2, 1_d4}));
+    TEST_EQUAL(t.min(), Rational(1, 2));
+    TEST_EQUAL(t.max(), 3);
+    TEST_EQUAL(t.pdf(Rational(1, 2)), Rational(1, 6));
+    TEST_EQUAL(t.pdf(1), Rational(1, 3));
+    TEST_EQUAL(t.pdf(Rational(3, 2)), Rational(1, 8));
+    TEST_EQUAL(t.pdf(Rational(5, 4)), 0);
+    TEST_EQUAL(t.pdf(3), Rational(1, 12));
+
+    TRY(t = Dice::max_of({1_d6, Dice("10")}));
+    TEST_EQUAL(t.min(), 10);
+    TEST_EQUAL(t.max(), 10);
+    TEST_EQUAL(t.pdf(10), 1);
+
+    // Values that would not fit in an int on a common grid
+
+    TRY(t = Dice::max_of({1_d6 / 7 + 200000, 1_d6 / 11 + 200000, 1_d6 / 13 + 200000, 1_d6 / 17 + 200000}));
+    TEST_EQUAL(t.min(), Rational(1400001, 7));
+    TEST_EQUAL(t.max(), Rational(1400006, 7));
+    TEST_EQUAL(t.pdf(Rational(1400006, 7)), Rational(1, 6));
+    TEST_EQUAL(t.cdf(Rational(1400005, 7)), Rational(5, 6));
+    TEST_EQUAL(t.pdf(Rational(2200006, 11)), Rational(1, 12));
+
+    TEST_THROW(Dice::max_of({}), std::invalid_argument);
+
+    TRY(t = Dice::max_of({2_d6, 1_d12, Dice("7")}));
+
+    for (int i = 0; i < iterations; ++i)
+        ++census[t(rng)];
+
+    for (int i = 7; i <= 12; ++i)
+        TEST_NEAR(double(census[i]) / iterations, double(t.pdf(i)), 0.005);
+
+}
+
+void test_rs_game_dice_keep_dice() {
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    Dice d;
+    std::mt19937_64 rng(42);
+    Statistics<double> stats;
+    Rational x;
+
+    TRY(d = Dice("4d6kh3"));
+    TEST_EQUAL(d.str(), "4d6kh3");
+    TEST_EQUAL(d.min(), 3);
+    TEST_EQUAL(d.max(), 18);
+    TEST_EQUAL(d.mean(), Rational(15869, 1296));
+    TEST_EQUAL(d.variance(), Rational(13612487, 1679616));
+    TEST_EQUAL(d.pdf(3),   Rational(1, 1296));
+    TEST_EQUAL(d.pdf(4),   Rational(4, 1296));
+    TEST_EQUAL(d.pdf(6),   Rational(21, 1296));
+    TEST_EQUAL(d.pdf(18),  Rational(21, 1296));
+    TEST_EQUAL(d.cdf(5),   Rational(15, 1296));
+
+    TRY(d = Dice("2d20kh1"));
+    TEST_EQUAL(d.str(), "2d20kh1");
+    TEST_EQUAL(d.mean(), Rational(553, 40));
+    TEST_EQUAL(d.pdf(1), Rational(1, 400));
+    TEST_EQUAL(d.pdf(20), Rational(39, 400));
+
+    TRY(d = Dice("2D20 KL 1"));
+    TEST_EQUAL(d.str(), "2d20kl1");
+    TEST_EQUAL(d.mean(), Rational(287, 40));
+    TEST_EQUAL(d.variance(), Rational(35511, 1600));
+    TEST_EQUAL(d.pdf(1), Rational(39, 400));
+    TEST_EQUAL(d.pdf(20), Rational(1, 400));
+
+    TRY(d = Dice("5d10dl2"));
+    TEST_EQUAL(d.str(), "5d10kh3");
+    TEST_EQUAL(d.min(), 3);
+    TEST_EQUAL(d.max(), 30);
+    TEST_EQUAL(d.mean(), Rational(85833, 4000));
+    TEST_EQUAL(d.variance(), Rational(303453711, 16000000));
+    TEST_EQUAL(d.pdf(4), Rational(5, 100000));
+    TEST_EQUAL(d.pdf(30), Rational(856, 100000));
+
+    TRY(d = Dice("3d6dh2"));
+    TEST_EQUAL(d.str(), "3d6kl1");
+    TEST_EQUAL(d.mean(), Rational(49, 24));
+    TEST_EQUAL(d.pdf(1), Rational(91, 216));
+
+    TRY(d = Dice("3d6kh3"));
+    TEST_EQUAL(d.str(), "3d6");
+    TRY(d = Dice("3d6dl0"));
+    TEST_EQUAL(d.str(), "3d6");
+    TRY(d = Dice("4d6kh3*2+4d6+1"));
+    TEST_EQUAL(d.str(), "4d6+4d6kh3*2+1");
+    TEST_EQUAL(d.min(), 11);
+    TEST_EQUAL(d.max(), 61);
+    TEST_EQUAL(d.mean(), Rational(15869, 648) + 15);
+    TRY(d = Dice("4d6kh3") + Dice("4d6kh3"));
+    TEST_EQUAL(d.str(), "4d6kh3+4d6kh3");
+    TEST_EQUAL(d.pdf(6), Rational(1, 1296 * 1296));
+
+    TEST_THROW(Dice("4d6kh0"), std::invalid_argument);
+    TEST_THROW(Dice("4d6kh5"), std::invalid_argument);
+    TEST_THROW(Dice("4d6dl4"), std::invalid_argument);
+    TEST_THROW(Dice("4d6k3"), std::invalid_argument);
+    TEST_THROW(Dice("4d6kh"), std::invalid_argument);
+    TEST_THROW(Dice("4kh3"), std::invalid_argument);
+
+    for (auto text: {"4d6kh3", "2d20kl1", "5d10dl2", "5d4kh2-d4"}) {
+        stats = {};
+        TRY(d = Dice(text));
+        for (int i = 0; i < iterations; ++i) {
+            TRY(x = d(rng));
+            TRY(stats(double(x)));
+        }
+        TEST_EQUAL(stats.min(), double(d.min()));
+        TEST_EQUAL(stats.max(), double(d.max()));
+        TEST_NEAR(stats.mean(), double(d.mean()), tolerance);
+        TEST_NEAR(stats.sd(), d.sd(), tolerance);
+    }
+
+    TRY(d = Dice("100d6kl2"));
+    TEST_EQUAL(d.min(), 2);
+    TEST_EQUAL(d.max(), 12);
+    TEST_NEAR(double(d.mean()), 2.000000265643, 1e-12);
+    TEST_NEAR(double(d.variance()), 2.897920933e-7, 1e-15);
+    TEST_NEAR(d.sd(), 5.383234096e-4, 1e-12);
+    TEST_NEAR(double((d + 3_d6).mean()), 12.500000265643, 1e-12);
+    TEST_NEAR(double((d + 3_d6).variance()), 8.750000289792, 1e-12);
+
+    for (int i = 0; i < 1000; ++i) {
+        TRY(x = d(rng));
+        TEST_EQUAL(x, 2);
+    }
+
+}
+
+void test_rs_game_dice_exploding_dice() {
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    Dice d;
+    IntDice id;
+    TableDice t;
+    std::mt19937_64 rng(42);
+    Statistics<double> stats;
+    Dice::distribution_arrays<double> exact;
+    Rational x, sum;
+    double mean = 0;
+
+    TRY(d = Dice("d6r1"));
+    TEST_EQUAL(d.str(), "d6r1");
+    TEST_EQUAL(d.min(), 2);
+    TEST_EQUAL(d.max(), 6);
+    TEST_EQUAL(d.mean(), 4);
+    TEST_EQUAL(d.variance(), 2);
+    TEST_EQUAL(d.pdf(1), 0);
+    TEST_EQUAL(d.pdf(2), Rational(1, 5));
+    TEST_EQUAL(d.pdf(6), Rational(1, 5));
+
+    TRY(d = Dice("3d6r2 + d6 + 3d6r2"));
+    TEST_EQUAL(d.str(), "d6+6d6r2");
+    TEST_EQUAL(d.min(), 19);
+    TEST_EQUAL(d.max(), 42);
+    TEST_EQUAL(d.mean(), Rational(61, 2));
+
+    TRY(d = Dice("4d6r1kh3"));
+    TEST_EQUAL(d.str(), "4d6r1kh3");
+    TEST_EQUAL(d.min(), 6);
+    TEST_EQUAL(d.max(), 18);
+    TEST_EQUAL(d.pdf(6), Rational(1, 625));
+    TEST_EQUAL(d.pdf(18), Rational(17, 625));
+
+    TRY(d = Dice("d6!"));
+    TEST_EQUAL(d.str(), "d6!");
+    TEST_EQUAL(d.min(), 1);
+    TEST_EQUAL(d.max(), 132);
+    TEST_EQUAL(d.mean(), Rational(21, 5));
+    TEST_EQUAL(d.variance(), Rational(266, 25));
+    TEST_EQUAL(d.pdf(1), Rational(1, 6));
+    TEST_EQUAL(d.pdf(5), Rational(1, 6));
+    TEST_EQUAL(d.pdf(6), 0);
+    TEST_EQUAL(d.pdf(7), Rational(1, 36));
+    TEST_EQUAL(d.pdf(12), 0);
+    TEST_EQUAL(d.pdf(13), Rational(1, 216));
+    TEST_EQUAL(d.cdf(11), Rational(35, 36));
+
+    TRY(d = Dice("d10!>=9"));
+    TEST_EQUAL(d.str(), "d10!>=9");
+    TEST_EQUAL(d.min(), 1);
+    TEST_EQUAL(d.max(), 240);
+    TEST_EQUAL(d.mean(), Rational(55, 8));
+    TEST_EQUAL(d.variance(), Rational(2145, 64));
+    TEST_EQUAL(d.pdf(9), 0);
+    TEST_EQUAL(d.pdf(12), Rational(1, 50));
+    TEST_NEAR(double(d.pdf(82)), 2.471e-7, 1e-15);
+    TEST_NEAR(double(d.cdf(82)), 0.9999989661, 1e-12);
+    TEST_NEAR(double(d.ccdf(90)), 3.327e-7, 1e-15);
+    TRY(d = Dice("d10!>=10"));
+    TEST_EQUAL(d.str(), "d10!");
+
+    TRY(d = Dice("2d6!"));
+    TEST_EQUAL(d.mean(), Rational(42, 5));
+    TEST_EQUAL(d.pdf(2), Rational(1, 36));
+    TEST_EQUAL(d.pdf(7), Rational(1, 9));
+    TEST_EQUAL(d.pdf(12), Rational(5, 108));
+
+    for (int i = 2; i <= 20; ++i)
+        TRY(sum += d.pdf(i));
+
+    TEST_EQUAL(sum, d.cdf(20));
+    TEST_EQUAL(d.max(), 264);
+    TEST_EQUAL(d.pdf(264), 0);
+    TEST_EQUAL(d.cdf(264), 1);
+
+    // The mean must agree with the capped table
+
+    TRY(exact = d.arrays<double>());
+    TRY(mean = std::inner_product(exact.values.begin(), exact.values.end(), exact.pdf.begin(), 0.0));
+    TEST_NEAR(mean, double(d.mean()), 1e-12);
+
+    TRY(d = Dice("3d6!"));
+    TEST_EQUAL(d.mean(), Rational(63, 5));
+    TEST_EQUAL(d.pdf(3), Rational(1, 216));
+    TEST_EQUAL(d.cdf(20), Rational(1175, 1296));
+    TEST_NEAR(double(d.pdf(30)), 0.002679183813, 1e-12);
+    TRY(t = TableDice(d));
+    TEST_EQUAL(t.pdf(3), Rational(1, 216));
+    TEST_EQUAL(t.cdf(20), Rational(1175, 1296));
+
+    TEST_THROW(Dice("d1!"), std::invalid_argument);
+    TEST_THROW(Dice("d6!>=1"), std::invalid_argument);
+    TEST_THROW(Dice("d6!>=7"), std::invalid_argument);
+    TEST_THROW(Dice("d6!>6"), std::invalid_argument);
+    TEST_THROW(Dice("d6r1!>=2"), std::invalid_argument);
+    TEST_THROW(Dice("d6r6"), std::invalid_argument);
+    TEST_THROW(Dice("d6r"), std::invalid_argument);
+    TEST_THROW(Dice("4d6!kh3"), std::invalid_argument);
+
+    for (auto text: {"d6!", "2d10!>=9", "d6r1", "10d6r2", "4d6r1kh3", "d8r1!-d4!"}) {
+        stats = {};
+        TRY(d = Dice(text));
+        for (int i = 0; i < iterations; ++i) {
+            TRY(x = d(rng));
+            TRY(stats(double(x)));
+        }
+        TEST(stats.min() >= double(d.min()));
+        TEST(stats.max() <= double(d.max()));
+        TEST_NEAR(stats.mean(), double(d.mean()), 3 * tolerance);
+        TEST_NEAR(stats.sd(), d.sd(), 3 * tolerance);
+    }
+
+    TRY(id = IntDice("3d6r1!"));
+    TEST_EQUAL(id.str(), "3d6r1!");
+    TEST_EQUAL(id.min(), 6);
+
+    for (int i = 0; i < 1000; ++i) {
+        int n = 0;
+        TRY(n = id(rng));
+        TEST(n >= 6);
+    }
+
+}
+
+void test_rs_game_dice_custom_faces() {
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    Dice d;
+    IntDice id;
+    std::mt19937_64 rng(42);
+    Statistics<double> stats;
+    Dice::distribution_arrays<double> exact;
+    Rational x;
+    int ones = 0;
+
+    TRY(d = Dice("4dF"));
+    TEST_EQUAL(d.str(), "4dF");
+    TEST_EQUAL(d.min(), -4);
+    TEST_EQUAL(d.max(), 4);
+    TEST_EQUAL(d.mean(), 0);
+    TEST_EQUAL(d.variance(), Rational(8, 3));
+    TEST_EQUAL(d.pdf(0), Rational(19, 81));
+    TEST_EQUAL(d.pdf(4), Rational(1, 81));
+    TEST_EQUAL(d.cdf(-1), Rational(31, 81));
+    TRY(d = 4_dF);
+    TEST_EQUAL(d.str(), "4dF");
+    TRY(d = Dice("dF + df"));
+    TEST_EQUAL(d.str(), "2dF");
+    TRY(d = Dice("2dF*3-1"));
+    TEST_EQUAL(d.str(), "2dF*3-1");
+    TEST_EQUAL(d.min(), -7);
+    TEST_EQUAL(d.max(), 5);
+    TEST_EQUAL(d.pdf(2), Rational(2, 9));
+
+    TRY(d = Dice("d{2,4,6,8}"));
+    TEST_EQUAL(d.str(), "d{2,4,6,8}");
+    TEST_EQUAL(d.min(), 2);
+    TEST_EQUAL(d.max(), 8);
+    TEST_EQUAL(d.mean(), 5);
+    TEST_EQUAL(d.variance(), 5);
+    TEST_EQUAL(d.pdf(3), 0);
+    TEST_EQUAL(d.pdf(4), Rational(1, 4));
+    TEST_EQUAL(d.cdf(5), Rational(1, 2));
+
+    TRY(d = Dice("d{1:3,2}"));
+    TEST_EQUAL(d.str(), "d{1:3,2}");
+    TEST_EQUAL(d.mean(), Rational(5, 4));
+    TEST_EQUAL(d.variance(), Rational(3, 16));
+    TEST_EQUAL(d.pdf(1), Rational(3, 4));
+    TRY(d = Dice("d{ -2, 2 }"));
+    TEST_EQUAL(d.str(), "d{-2,2}");
+    TEST_EQUAL(d.mean(), 0);
+    TEST_EQUAL(d.variance(), 4);
+    TRY(d = Dice(3, {1, 1, 2}));
+    TEST_EQUAL(d.str(), "3d{1:2,2}");
+    TEST_EQUAL(d.pdf(3), Rational(8, 27));
+    TRY(d = Dice("d{4:2,2:2}+d{2,4}"));
+    TEST_EQUAL(d.str(), "2d{2,4}");
+
+    TRY(d = Dice("d{3,1,2}"));
+    TEST_EQUAL(d.str(), "d3");
+    TRY(d = Dice("d{3,4,5,6}"));
+    TEST_EQUAL(d.str(), "d6r2");
+    TRY(d = Dice("2d{5}+1"));
+    TEST_EQUAL(d.str(), "11");
+    TRY(d = Dice("d{2,4,6,8}+4dF"));
+    TEST_EQUAL(d.str(), "d{2,4,6,8}+4dF");
+
+    TEST_THROW(Dice("d{}"), std::invalid_argument);
+    TEST_THROW(Dice("d{1,}"), std::invalid_argument);
+    TEST_THROW(Dice("d{1,2"), std::invalid_argument);
+    TEST_THROW(Dice("d{1:0,2}"), std::invalid_argument);
+    TEST_THROW(Dice("dFr1"), std::invalid_argument);
+    TEST_THROW(Dice("dF!"), std::invalid_argument);
+    TEST_THROW(Dice("4dFkh2"), std::invalid_argument);
+    TEST_THROW(Dice(1, std::vector<int>{}), std::invalid_argument);
+
+    TRY(d = Dice("3dF+d{2,4,6,8}*2"));
+    TRY(exact = d.arrays<double>());
+    for (size_t i = 0; i < exact.values.size(); ++i)
+        TEST_NEAR(d.approx_pdf(int(exact.values[i])), exact.pdf[i], 1e-12);
+
+    for (auto text: {"4dF", "d{1:3,2}", "2d{-5,0:2,10}*3+1", "d{2,4,6,8}-3dF"}) {
+        stats = {};
+        TRY(d = Dice(text));
+        for (int i = 0; i < iterations; ++i) {
+            TRY(x = d(rng));
+            TRY(stats(double(x)));
+        }
+        TEST(stats.min() >= double(d.min()));
+        TEST(stats.max() <= double(d.max()));
+        TEST_NEAR(stats.mean(), double(d.mean()), 3 * tolerance);
+        TEST_NEAR(stats.sd(), d.sd(), 3 * tolerance);
+    }
+
+    TRY(d = Dice("d{1:3,2}"));
+    for (int i = 0; i < iterations; ++i)
+        if (d(rng) == 1)
+            ++ones;
+    TEST_NEAR(double(ones) / iterations, 0.75, 0.01);
+
+    TRY(id = IntDice("4dF+4"));
+    TEST_EQUAL(id.str(), "4dF+4");
+    TEST_EQUAL(id.min(), 0);
+    TEST_EQUAL(id.max(), 8);
+
+    for (int i = 0; i < 1000; ++i) {
+        int n = 0;
+        TRY(n = id(rng));
+        TEST(n >= 0 && n <= 8);
+    }
+
+}
+
+void test_rs_game_dice_compiled() {
+
+    Dice d;
+    CompiledDice c;
+    Rational x, y;
+    Rational rolls[100];
+
+    TEST_EQUAL(c.str(), "0");
+    TEST_EQUAL(c.min(), 0);
+    TEST_EQUAL(c.max(), 0);
+
+    for (auto text: {"3d6", "2d10x5+3d6+10", "12d6/2-1", "4d6kh3+2d20kl1", "5d10dl2", "20d8kh10", "10d1000kh3", "80d300kl5",
+            "d6!+2d10!>=9", "3d6r1", "4dF+d{2,4,6,8}*3", "d{1:3,2}-d4"}) {
+
+        TRY(d = Dice(text));
+        TRY(c = d.compile());
+        TEST_EQUAL(c.str(), d.str());
+        TEST_EQUAL(c.min(), d.min());
+        TEST_EQUAL(c.max(), d.max());
+
+        // The compiled form draws the same random numbers in the same
+        // order, so it gives exactly the same results
+
+        std::mt19937 rng1(42), rng2(42);
+        std::minstd_rand rng3(86), rng4(86);
+
+        for (int i = 0; i < 1000; ++i) {
+            TRY(x = c(rng1));
+            TRY(y = d(rng2));
+            TEST_EQUAL(x, y);
+            TRY(x = c(rng3));
+            TRY(y = d(rng4));
+            TEST_EQUAL(x, y);
+        }
+
+        Rational expect[100];
+        TRY(c.roll_n(rng1, rolls, 100));
+        TRY(d.roll_n(rng2, expect, 100));
+        for (int i = 0; i < 100; ++i)
+            TEST_EQUAL(rolls[i], expect[i]);
+
+    }
+
+}
+
+void test_rs_game_dice_simulator() {
+
+    Dice a, b;
+    TableDice t;
+    DiceSimulator sim(4, 42);
+    EmpiricalDistribution e, f;
+
+    TEST_EQUAL(sim.threads(), 4u);
+    TEST_EQUAL(sim.seed(), 42u);
+    TEST(DiceSimulator().threads() >= 1);
+
+    TRY(a = Dice("3d6"));
+    TRY(e = sim(a, 1'000'000));
+    TEST_EQUAL(e.trials(), 1'000'000u);
+    TEST_EQUAL(e.min(), 3);
+    TEST_EQUAL(e.max(), 18);
+    TEST_NEAR(e.mean(), 10.5, 0.01);
+    TEST_NEAR(e.sd(), a.sd(), 0.01);
+    TEST_NEAR(e.pdf(10), 27.0 / 216, 0.002);
+    TEST_NEAR(e.cdf(10), 0.5, 0.002);
+    TEST_NEAR(e.ccdf(11), 0.5, 0.002);
+    TEST_EQUAL(e.cdf(2), 0);
+    TEST_EQUAL(e.cdf(18), 1);
+    TEST_EQUAL(e.ccdf(3), 1);
+    TEST_EQUAL(e.ccdf(19), 0);
+    TEST(e.distance(a) < 0.005);
+    TEST(e.distance(Dice("3d6+1")) > 0.05);
+
+    // The results depend only on the seed, not the number of threads
+
+    TRY(e = DiceSimulator(1, 86)(a, 300'000));
+    TRY(f = DiceSimulator(3, 86)(a, 300'000));
+    TEST(e.counts() == f.counts());
+    TRY(f = DiceSimulator(3, 87)(a, 300'000));
+    TEST(e.counts() != f.counts());
+    TRY(f = DiceSimulator(1000, 86)(a, 300'000));
+    TEST(e.counts() == f.counts());
+
+    TRY(a = Dice("d20+5"));
+    TRY(b = Dice("d20+5"));
+    TRY(t = Dice::max_of({a, b}));
+    TRY(e = sim([&a,&b] (auto& rng) { return std::max(a(rng), b(rng)); }, 400'000));
+    TEST_EQUAL(e.trials(), 400'000u);
+    TEST_EQUAL(e.min(), 6);
+    TEST_EQUAL(e.max(), 25);
+    for (int x = 6; x <= 25; ++x)
+        TEST_NEAR(e.pdf(x), double(t.pdf(x)), 0.002);
+
+    TRY(a = Dice("2000d1000"));
+    TRY(e = sim(a, 100'000));
+    TEST_EQUAL(e.trials(), 100'000u);
+    TEST_NEAR(e.mean(), 1'001'000, 100);
+    TEST(e.distance(a) < 0.01);
+
+    TRY(e = sim(a, 0));
+    TEST_EQUAL(e.trials(), 0u);
+    TEST_EQUAL(e.mean(), 0);
+
+    TEST_THROW(sim([] (auto&) -> int { throw std::runtime_error("Fail"); }, 1000), std::runtime_error);
+    TEST_THROW(sim([] (auto&) -> int { throw std::runtime_error("Fail"); }, 1'000'000), std::runtime_error);
+
+}
+
+void test_rs_game_dice_pool() {
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    DicePool p;
+    std::mt19937_64 rng64(42);
+    std::minstd_rand rng32(42);
+    Statistics<double> stats;
+    std::map<int, int> census;
+    int x = 0;
+
+    TEST_EQUAL(p.str(), "0");
+    TEST_EQUAL(p.min(), 0);
+    TEST_EQUAL(p.max(), 0);
+    TEST_EQUAL(p.pdf(0), 1);
+    TRY(x = p(rng64));
+    TEST_EQUAL(x, 0);
+
+    TRY(p = DicePool("8d10>=7"));
+    TEST_EQUAL(p.str(), "8d10>=7");
+    TEST_EQUAL(p.min(), 0);
+    TEST_EQUAL(p.max(), 8);
+    TEST_EQUAL(p.mean(), Rational(16, 5));
+    TEST_EQUAL(p.variance(), Rational(48, 25));
+    TEST_EQUAL(p.pdf(-1), 0);
+    TEST_EQUAL(p.pdf(0), Rational(6561, 390625));
+    TEST_EQUAL(p.pdf(8), Rational(256, 390625));
+    TEST_EQUAL(p.cdf(0), Rational(6561, 390625));
+    TEST_EQUAL(p.cdf(8), 1);
+    TEST_EQUAL(p.ccdf(1), Rational(384064, 390625));
+    TEST_EQUAL(p.ccdf(9), 0);
+
+    TRY(p = DicePool("8D10 >= 7 F1"));
+    TEST_EQUAL(p.str(), "8d10>=7f1");
+    TEST_EQUAL(p.min(), -8);
+    TEST_EQUAL(p.max(), 8);
+    TEST_EQUAL(p.mean(), Rational(12, 5));
+    TEST_EQUAL(p.variance(), Rational(82, 25));
+    TEST_EQUAL(p.pdf(-8), Rational(1, 100'000'000));
+    TEST_EQUAL(p.pdf(8), Rational(256, 390625));
+
+    TRY(p = DicePool("3d6>=5 + 2d10>=8f1 + 2"));
+    TEST_EQUAL(p.str(), "2d10>=8f1+3d6>=5+2");
+    TEST_EQUAL(p.min(), 0);
+    TEST_EQUAL(p.max(), 7);
+    TEST_EQUAL(p.mean(), Rational(17, 5));
+    TRY(p = DicePool(3, 6, 5) + DicePool("2d10>=8f1") + 2);
+    TEST_EQUAL(p.str(), "2d10>=8f1+3d6>=5+2");
+
+    TRY(p = DicePool(100, 10, 7));
+    TEST_EQUAL(p.mean(), 40);
+    TEST_NEAR(double(p.pdf(40)), 0.081219145, 1e-9);
+    TEST_NEAR(double(p.cdf(40)), 0.543294486, 1e-9);
+    TEST_EQUAL(p.cdf(100), 1);
+
+    TEST_THROW(DicePool("8d10"), std::invalid_argument);
+    TEST_THROW(DicePool("8d10>7"), std::invalid_argument);
+    TEST_THROW(DicePool("8d10>=0"), std::invalid_argument);
+    TEST_THROW(DicePool("99999999999d10>=7"), std::invalid_argument);
+    TEST_THROW(DicePool("8d10>=11"), std::invalid_argument);
+    TEST_THROW(DicePool("8d10>=7f7"), std::invalid_argument);
+    TEST_THROW(DicePool("-8d10>=7"), std::invalid_argument);
+    TEST_THROW(DicePool(8, 10, 11), std::invalid_argument);
+
+    for (auto text: {"8d10>=7", "8d10>=7f1", "3d6>=5+2d10>=8f1+2", "200d6>=6f2"}) {
+        TRY(p = DicePool(text));
+        stats = {};
+        for (int i = 0; i < iterations; ++i) {
+            TRY(x = p(rng64));
+            TRY(stats(x));
+        }
+        TEST(stats.min() >= p.min());
+        TEST(stats.max() <= p.max());
+        TEST_NEAR(stats.mean(), double(p.mean()), tolerance);
+        TEST_NEAR(stats.sd(), p.sd(), tolerance);
+        stats = {};
+        for (int i = 0; i < iterations; ++i) {
+            TRY(x = p(rng32));
+            TRY(stats(x));
+        }
+        TEST_NEAR(stats.mean(), double(p.mean()), tolerance);
+        TEST_NEAR(stats.sd(), p.sd(), tolerance);
+    }
+
+    std::vector<int> v(iterations);
+    TRY(p = DicePool("8d10>=7f1"));
+    TRY(p.roll_n(rng64, v.data(), v.size()));
+
+    for (auto y: v)
+        ++census[y];
+
+    for (int i = -8; i <= 8; ++i)
+        TEST_NEAR(double(census[i]) / iterations, double(p.pdf(i)), 0.005);
+
+}
+
+void test_rs_game_dice_static_dice() {
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    using D6 = StaticDice<1, 6>;
+    using D3d6 = StaticDice<3, 6, 2>;
+    using D18d10 = StaticDice<18, 10>;
+
+    static_assert(D6::min() == 1);
+    static_assert(D6::max() == 6);
+    static_assert(D6::mean() == 3.5);
+    static_assert(D6::total() == 6);
+    static_assert(D3d6::min() == 5);
+    static_assert(D3d6::max() == 20);
+    static_assert(D3d6::mean() == 12.5);
+    static_assert(D3d6::variance() == 8.75);
+    static_assert(D3d6::table_size == 16);
+    static_assert(D3d6::total() == 216);
+    static_assert(D3d6::counts[0] == 1);
+    static_assert(D3d6::counts[5] == 21);
+    static_assert(D3d6::cumulative[5] == 35);
+    static_assert(D3d6::pdf(12) == 27 / 216.0);
+    static_assert(D3d6::cdf(4) == 0);
+    static_assert(D3d6::cdf(20) == 1);
+    static_assert(D3d6::ccdf(5) == 1);
+    static_assert(D3d6::ccdf(21) == 0);
+    static_assert(StaticDice<0, 6, 3>::min() == 3);
+    static_assert(StaticDice<0, 6, 3>::pdf(3) == 1);
+
+    Dice d;
+    std::mt19937 rng32(42);
+    std::minstd_rand rng_small(42);
+    Statistics<double> stats;
+    int x = 0;
+
+    TEST_EQUAL(D3d6::str(), "3d6+2");
+    TRY(d = D3d6::dice());
+    TEST_EQUAL(d.str(), "3d6+2");
+
+    for (int i = 5; i <= 20; ++i) {
+        TEST_EQUAL(D3d6::pdf(i), double(d.pdf(i)));
+        TEST_EQUAL(D3d6::cdf(i), double(d.cdf(i)));
+        TEST_EQUAL(D3d6::ccdf(i), double(d.ccdf(i)));
+    }
+
+    TRY(d = D18d10::dice());
+    TEST_EQUAL(D18d10::total(), 1'000'000'000'000'000'000ull);
+    TEST_NEAR(D18d10::pdf(99), d.approx_pdf(99), 1e-15);
+    TEST_NEAR(D18d10::cdf(90), d.approx_cdf(90), 1e-12);
+    TEST_NEAR(D18d10::sd(), d.sd(), 1e-12);
+
+    stats = {};
+    for (int i = 0; i < iterations; ++i) {
+        TRY(x = D3d6()(rng_small));
+        TRY(stats(x));
+    }
+    TEST_EQUAL(stats.min(), 5);
+    TEST_EQUAL(stats.max(), 20);
+    TEST_NEAR(stats.mean(), D3d6::mean(), tolerance);
+    TEST_NEAR(stats.sd(), D3d6::sd(), tolerance);
+
+    stats = {};
+    for (int i = 0; i < iterations; ++i) {
+        TRY(x = D18d10()(rng32));
+        TRY(stats(x));
+    }
+    TEST(stats.min() >= 18);
+    TEST(stats.max() <= 180);
+    TEST_NEAR(stats.mean(), D18d10::mean(), 3 * tolerance);
+    TEST_NEAR(stats.sd(), D18d10::sd(), 3 * tolerance);
+
+}
+
 void test_rs_game_dice_integer_arithmetic() {
 
     IntDice a, b, c;
@@ -385,6 +1723,58 @@ void test_rs_game_dice_integer_generation() {
 
 }
 
+void test_rs_game_dice_integer_consistency() {
+
+    Dice d;
+    IntDice i;
+    std::minstd_rand rng1(42), rng2(42);
+
+    for (auto str: {"2d6", "2d10-2d6+10", "2d10*3/4-d6/3+5/2", "-3d8/2", "20d6*2-7"}) {
+        TRY(d = Dice(str));
+        TRY(i = IntDice(str));
+        TEST_EQUAL(i.str(), d.str());
+        TEST_EQUAL(i.min(), d.min().floor());
+        TEST_EQUAL(i.max(), d.max().floor());
+        for (int j = 0; j < 1000; ++j)
+            TEST_EQUAL(i(rng1), d(rng2).floor());
+    }
+
+}
+
+void test_rs_game_dice_integer_batch_generation() {
+
+    static constexpr int iterations = 100'000;
+    static constexpr double tolerance = 0.05;
+
+    IntDice d;
+    std::minstd_rand rng(42);
+    Statistics<double> stats;
+    std::vector<int> results(iterations);
+
+    TRY(d = IntDice("2d10-2d6+10"));
+    TRY(d.roll_n(rng, results.data(), results.size()));
+
+    for (auto x: results)
+        TRY(stats(double(x)));
+
+    TEST_EQUAL(stats.min(), d.min());
+    TEST_EQUAL(stats.max(), d.max());
+    TEST_NEAR(stats.mean(), 14, tolerance);
+    TEST_NEAR(stats.sd(), 4.725816, tolerance);
+
+    stats = {};
+    TRY(d = IntDice("-d6/4"));
+    TRY(d.roll_n(rng, results.data(), 1000));
+
+    for (int i = 0; i < 1000; ++i)
+        TRY(stats(double(results[i])));
+
+    TEST_EQUAL(stats.min(), -2);
+    TEST_EQUAL(stats.max(), -1);
+    TEST_NEAR(stats.mean(), -4.0 / 3.0, tolerance);
+
+}
+
 void test_rs_game_dice_integer_literals() {
 
     IntDice d;
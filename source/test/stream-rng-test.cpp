@@ -0,0 +1,152 @@
+#include "rs-game/stream-rng.hpp"
+#include "rs-game/dice.hpp"
+#include "rs-game/markov.hpp"
+#include "rs-game/text-gen.hpp"
+#include "rs-sci/rational.hpp"
+#include "rs-unit-test.hpp"
+#include <array>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace RS::Game;
+using namespace RS::Sci;
+
+void test_rs_game_stream_rng_known_answers() {
+
+    // Test vectors from the Random123 distribution
+
+    using counter = std::array<std::uint32_t, 4>;
+    using key = std::array<std::uint32_t, 2>;
+
+    counter x;
+
+    TRY(x = StreamRng::philox({{0, 0, 0, 0}}, {{0, 0}}));
+    TEST_EQUAL(x[0], 0x6627e8d5u);
+    TEST_EQUAL(x[1], 0xe169c58du);
+    TEST_EQUAL(x[2], 0xbc57ac4cu);
+    TEST_EQUAL(x[3], 0x9b00dbd8u);
+
+    TRY(x = StreamRng::philox(counter{{~ 0u, ~ 0u, ~ 0u, ~ 0u}}, key{{~ 0u, ~ 0u}}));
+    TEST_EQUAL(x[0], 0x408f276du);
+    TEST_EQUAL(x[1], 0x41c83b0eu);
+    TEST_EQUAL(x[2], 0xa20bc7c6u);
+    TEST_EQUAL(x[3], 0x6d5451fdu);
+
+    TRY(x = StreamRng::philox({{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}}, {{0xa4093822, 0x299f31d0}}));
+    TEST_EQUAL(x[0], 0xd16cfe09u);
+    TEST_EQUAL(x[1], 0x94fdccebu);
+    TEST_EQUAL(x[2], 0x5001e420u);
+    TEST_EQUAL(x[3], 0x24126ea1u);
+
+    StreamRng rng;
+    std::uint64_t y = 0;
+
+    TRY(y = rng());
+    TEST_EQUAL(y, 0xe169c58d6627e8d5ull);
+    TRY(y = rng());
+    TEST_EQUAL(y, 0x9b00dbd8bc57ac4cull);
+
+    static constexpr auto z = [] { StreamRng r(1); r(); return r(); }();
+    static_assert(z == 0xb615aa2795f222c0ull);
+
+}
+
+void test_rs_game_stream_rng_streams() {
+
+    StreamRng a(42), b(42), c(42, 1);
+    std::vector<std::uint64_t> v, w;
+
+    TEST_EQUAL(a.stream(), 0u);
+    TEST_EQUAL(c.stream(), 1u);
+    TEST(a == b);
+    TEST(a != c);
+    TEST(a.stream(1) == c);
+
+    for (int i = 0; i < 100; ++i) {
+        v.push_back(a());
+        w.push_back(c());
+    }
+
+    TEST(v != w);
+    TEST(a != b);
+
+    for (int i = 0; i < 100; ++i)
+        TEST_EQUAL(b(), v[i]);
+
+    TEST(a == b);
+
+    for (int n: {0, 1, 2, 3, 10, 11}) {
+        for (int start: {0, 1, 2, 5}) {
+            StreamRng d(86), e(86);
+            for (int i = 0; i < start + n; ++i)
+                d();
+            for (int i = 0; i < start; ++i)
+                e();
+            TRY(e.discard(n));
+            TEST(d == e);
+            TEST_EQUAL(d(), e());
+        }
+    }
+
+    TRY(a.seed(42));
+    TRY(a.jump());
+    TEST_EQUAL(a.stream(), 1u);
+    TEST_EQUAL(a(), w[0]);
+
+    // Jumping keeps the position, even partway through a block
+
+    for (int start: {1, 2, 3, 5}) {
+        StreamRng d(42), e(42, 1);
+        for (int i = 0; i < start; ++i)
+            d();
+        TRY(e.discard(start));
+        TRY(d.jump());
+        TEST(d == e);
+        for (int i = start; i < start + 4; ++i)
+            TEST_EQUAL(d(), w[i]);
+    }
+
+    TRY(a.seed(42));
+    TEST_EQUAL(a(), v[0]);
+
+    double sum = 0;
+    std::uniform_real_distribution<double> unit;
+
+    for (int i = 0; i < 100'000; ++i)
+        sum += unit(a);
+
+    TEST_NEAR(sum / 100'000, 0.5, 0.01);
+
+}
+
+void test_rs_game_stream_rng_generators() {
+
+    // Each generator gives the same results from the same stream
+
+    Dice dice("3d6+d{1:3,2}");
+    IntDice int_dice("4d6kh3");
+    CMarkov markov(2);
+    TextGen text = TextGen::choice("alpha bravo charlie delta echo foxtrot golf hotel")
+        + " " + TextGen::number(1, 100);
+
+    TRY(markov.add("abracadabra"));
+    TRY(markov.add("alakazam"));
+
+    for (std::uint64_t k = 0; k < 10; ++k) {
+
+        StreamRng rng1(99, k), rng2(99, k);
+
+        for (int i = 0; i < 100; ++i) {
+            TEST_EQUAL(dice(rng1), dice(rng2));
+            TEST_EQUAL(int_dice(rng1), int_dice(rng2));
+            TEST_EQUAL(markov(rng1), markov(rng2));
+            TEST_EQUAL(text(rng1), text(rng2));
+        }
+
+        TEST(rng1 == rng2);
+
+    }
+
+}
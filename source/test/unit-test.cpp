@@ -11,12 +11,35 @@ int main(int argc, char** argv) {
     UNIT_TEST(rs_game_dice_statistics)
     UNIT_TEST(rs_game_dice_parser)
     UNIT_TEST(rs_game_dice_generation)
+    UNIT_TEST(rs_game_dice_vectorized_generation)
     UNIT_TEST(rs_game_dice_literals)
     UNIT_TEST(rs_game_dice_pdf)
+    UNIT_TEST(rs_game_dice_batch_generation)
+    UNIT_TEST(rs_game_dice_mixed_pdf)
+    UNIT_TEST(rs_game_dice_large_pools)
+    UNIT_TEST(rs_game_dice_concurrent_pdf)
+    UNIT_TEST(rs_game_dice_compare)
+    UNIT_TEST(rs_game_dice_quantile)
+    UNIT_TEST(rs_game_dice_arrays)
+    UNIT_TEST(rs_game_dice_approximation)
+    UNIT_TEST(rs_game_dice_table_cache)
+    UNIT_TEST(rs_game_dice_incremental_pdf)
+    UNIT_TEST(rs_game_dice_parallel_tables)
+    UNIT_TEST(rs_game_dice_table_generation)
+    UNIT_TEST(rs_game_dice_extreme_of)
+    UNIT_TEST(rs_game_dice_keep_dice)
+    UNIT_TEST(rs_game_dice_exploding_dice)
+    UNIT_TEST(rs_game_dice_custom_faces)
+    UNIT_TEST(rs_game_dice_compiled)
+    UNIT_TEST(rs_game_dice_simulator)
+    UNIT_TEST(rs_game_dice_pool)
+    UNIT_TEST(rs_game_dice_static_dice)
     UNIT_TEST(rs_game_dice_integer_arithmetic)
     UNIT_TEST(rs_game_dice_integer_statistics)
     UNIT_TEST(rs_game_dice_integer_parser)
     UNIT_TEST(rs_game_dice_integer_generation)
+    UNIT_TEST(rs_game_dice_integer_consistency)
+    UNIT_TEST(rs_game_dice_integer_batch_generation)
     UNIT_TEST(rs_game_dice_integer_literals)
 
     // english-test.cpp
@@ -43,6 +66,11 @@ int main(int argc, char** argv) {
     UNIT_TEST(rs_game_markov_character_mode)
     UNIT_TEST(rs_game_markov_string_mode)
 
+    // stream-rng-test.cpp
+    UNIT_TEST(rs_game_stream_rng_known_answers)
+    UNIT_TEST(rs_game_stream_rng_streams)
+    UNIT_TEST(rs_game_stream_rng_generators)
+
     // text-gen-test.cpp
     UNIT_TEST(rs_game_text_generation_null)
     UNIT_TEST(rs_game_text_generation_constant)